@@ -0,0 +1,443 @@
+#include "pch.h"
+#include "AppearanceSolver.h"
+#include "AccuracyCost.h"
+#include "BRDFs.h"
+#include "utils.h"
+
+
+// Microbenchmarks of the hot kernels of the solver on a small synthetic scene, so that no capture is needed.
+// usage: benchmark [--filter <substring>] [--min-time <seconds>] [--out <file.json>]
+
+
+static volatile double benchmarkSink = 0.0;
+
+
+struct BenchmarkResult {
+	std::string name;
+	long long iterations;
+	double nsPerOp;
+	std::string unit;
+};
+
+
+class SolverBenchmark
+{
+	static constexpr int kSize = 64;
+	static constexpr int kDomainStart = 16;
+	static constexpr int kDomainSize = 32;
+	static constexpr int kNumLights = 750;
+	static constexpr int kNumViews = 12;
+
+	std::string filter;
+	double minTime = 0.2;
+	std::vector<BenchmarkResult> results;
+
+	bool enabled(const std::string& name) const {
+		return filter.empty() || name.find(filter) != std::string::npos;
+	}
+
+	// Runs func in growing batches until minTime has passed. func returns how many operations it did.
+	template<typename Func>
+	void run(const std::string& name, const std::string& unit, double opsPerUnit, Func&& func)
+	{
+		if (!enabled(name))
+			return;
+
+		func();
+
+		long long batch = 1;
+		long long iterations = 0;
+		double ops = 0.0;
+		double elapsed = 0.0;
+		while (elapsed < minTime)
+		{
+			auto start = std::chrono::steady_clock::now();
+			for (long long i = 0; i < batch; ++i)
+				ops += func();
+			elapsed += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			iterations += batch;
+			batch *= 2;
+		}
+
+		double nsPerOp = elapsed * 1e9 / ops * opsPerUnit;
+		results.push_back({ name, iterations, nsPerOp, unit });
+		fprintf(stderr, "%-56s %14.1f ns/%s\n", name.c_str(), nsPerOp, unit.c_str());
+	}
+
+	// A dome with the rectangular light of the rig in front of it, and the cameras on an arc around it.
+	static void buildScene(AppearanceSolver& s, NormalOptMode normalMode, ParamSpace params)
+	{
+		std::mt19937 rng(7);
+		std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+		s.problemOpts.normalMode = normalMode;
+		s.problemOpts.params = params;
+		s.domain.set(kDomainStart, kDomainStart, kDomainSize, kDomainSize);
+
+		s.lightSamples.clear();
+		for (int i = 0; i < kNumLights; ++i)
+		{
+			AppearanceSolver::LightSample l;
+			l.position = { -60.0 + 120.0 * unit(rng), -40.0 + 80.0 * unit(rng), 120.0 };
+			l.normal = { 0.0, 0.0, -1.0 };
+			l.emittance = { 40.0, 40.0, 40.0 };
+			l.area = 120.0 * 80.0 / kNumLights;
+			s.lightSamples.push_back(l);
+		}
+
+		auto& positions = s.positionMap.edit();
+		auto& normals = s.geoNormalMap.edit();
+		positions.resize(kSize * kSize);
+		normals.resize(kSize * kSize);
+		for (int y = 0; y < kSize; ++y)
+			for (int x = 0; x < kSize; ++x)
+		{
+			double u = 2.0 * x / (kSize - 1) - 1.0;
+			double v = 2.0 * y / (kSize - 1) - 1.0;
+			Eigen::Vector3d P(10.0 * u, 10.0 * v, 10.0 * std::sqrt(std::max(2.0 - u * u - v * v, 0.0)));
+			positions[y * kSize + x] = toTexel(P);
+			normals[y * kSize + x] = toTexel(Eigen::Vector3d(u, v, std::sqrt(std::max(2.0 - u * u - v * v, 0.0))).normalized());
+		}
+
+		s.views.clear();
+		for (int v = 0; v < kNumViews; ++v)
+		{
+			double angle = -0.8 + 1.6 * v / (kNumViews - 1);
+			AppearanceSolver::ViewData view;
+			view.cameraId = v + 1;
+			view.cameraPos = { 100.0 * std::sin(angle), 0.0, 100.0 * std::cos(angle) };
+
+			auto& radiance = view.trgViewMap.stored().edit();
+			auto& weights = view.weightMap.stored().edit();
+			radiance.resize(kSize * kSize);
+			weights.resize(kSize * kSize);
+			for (int p = 0; p < kSize * kSize; ++p)
+			{
+				radiance[p] = Eigen::Vector4f(0.3f + 0.2f * (float)unit(rng), 0.2f, 0.15f, 0.0f);
+				weights[p] = (float)unit(rng);
+			}
+			s.views.push_back(std::move(view));
+		}
+
+		auto& shadows = s.shadowTable.edit(kSize * kSize, (kNumLights + 31) / 32);
+		for (auto& word : shadows)
+			word = (uint)rng() | (uint)rng();
+
+		s.loadedWindow = { 0, kSize, 0, kSize };
+		s.allocateMaps();
+		s.resetSolution();
+		s.computeTBNMatrix();
+		s.prepareViewMasks();
+		s.bUseShadow = true;
+	}
+
+	static std::string paramName(ParamSpace params)
+	{
+		std::string name;
+		if (params & param_diffuse)		name += "d";
+		if (params & param_specular)	name += "s";
+		if (params & param_roughness)	name += "r";
+		if (params & param_normal)		name += "n";
+		return name;
+	}
+
+	static std::string modeName(NormalOptMode mode)
+	{
+		switch (mode)
+		{
+		case NormalOptMode::raw_normal:		return "raw_normal";
+		case NormalOptMode::raw_normal2D:	return "raw_normal2D";
+		case NormalOptMode::heightmap:		return "heightmap";
+		case NormalOptMode::heightmap2018:	return "heightmap2018";
+		case NormalOptMode::heightmap2020:	return "heightmap2020";
+		}
+		return "";
+	}
+
+	// Evaluates the residuals and every Jacobian block of a cost function.
+	static void evaluateWithJacobians(const ceres::CostFunction* cost, const std::vector<double*>& params,
+		std::vector<double>& residuals, std::vector<std::vector<double>>& jacobians, std::vector<double*>& jacobianPtrs)
+	{
+		const auto& sizes = cost->parameter_block_sizes();
+		residuals.resize(cost->num_residuals());
+		jacobians.resize(sizes.size());
+		jacobianPtrs.resize(sizes.size());
+		for (size_t i = 0; i < sizes.size(); ++i)
+		{
+			jacobians[i].resize((size_t)cost->num_residuals() * sizes[i]);
+			jacobianPtrs[i] = jacobians[i].data();
+		}
+		cost->Evaluate(params.data(), residuals.data(), jacobianPtrs.data());
+	}
+
+	void benchBRDF()
+	{
+		using Jet = ceres::Jet<double, 4>;
+
+		std::mt19937 rng(11);
+		std::uniform_real_distribution<double> spread(-0.4, 0.4);
+		std::vector<Eigen::Vector3d> dirs(256);
+		for (auto& dir : dirs)
+			dir = Eigen::Vector3d(spread(rng), spread(rng), 1.0).normalized();
+
+		run("brdf_ggx/double", "call", 1.0, [&]() {
+			double sum = 0.0;
+			for (size_t i = 0; i < dirs.size(); ++i)
+				sum += brdf_ggx<double, double>(dirs[i], dirs[(i + 1) % dirs.size()], dirs[(i + 7) % dirs.size()], 0.3);
+			benchmarkSink = benchmarkSink + sum;
+			return (double)dirs.size();
+		});
+
+		run("brdf_ggx/jet", "call", 1.0, [&]() {
+			double sum = 0.0;
+			for (size_t i = 0; i < dirs.size(); ++i)
+			{
+				Eigen::Vector<Jet, 3> N(Jet(dirs[i][0], 0), Jet(dirs[i][1], 1), Jet(dirs[i][2], 2));
+				sum += brdf_ggx<Jet, double>(N, dirs[(i + 1) % dirs.size()], dirs[(i + 7) % dirs.size()], Jet(0.3, 3)).a;
+			}
+			benchmarkSink = benchmarkSink + sum;
+			return (double)dirs.size();
+		});
+	}
+
+	void benchEvaluate()
+	{
+		AppearanceSolver s(kSize, kSize);
+		buildScene(s, NormalOptMode::raw_normal, param_diffuse | param_specular | param_roughness | param_normal);
+
+		for (bool bShadow : { false, true })
+		{
+			s.bUseShadow = bShadow;
+			run(std::string("evaluate/") + (bShadow ? "shadow" : "no_shadow"), "call", 1.0, [&]() {
+				double sum = 0.0;
+				int count = 0;
+				for (int p : s.domain)
+				{
+					for (int v = 0; v < (int)s.views.size(); ++v, ++count)
+						sum += s.evaluate<double>(v, p, s.diffuseMap[p], s.specularMap[p], s.roughnessMap[p], s.normalMap[p])[0];
+					if (count >= 4096)
+						break;
+				}
+				benchmarkSink = benchmarkSink + sum;
+				return (double)count;
+			});
+		}
+	}
+
+	void benchAccuracyCost()
+	{
+		const NormalOptMode modes[] = {
+			NormalOptMode::raw_normal, NormalOptMode::raw_normal2D, NormalOptMode::heightmap,
+			NormalOptMode::heightmap2018, NormalOptMode::heightmap2020 };
+
+		for (int bits = 1; bits < 16; ++bits)
+		{
+			ParamSpace params = (ParamSpace)bits;
+			for (NormalOptMode mode : modes)
+			{
+				// The normal mode only matters when the normal is solved for.
+				if (!(params & param_normal) && mode != NormalOptMode::raw_normal)
+					continue;
+
+				std::string name = "AccuracyCost/" + paramName(params) + "/" + modeName(mode);
+				if (!enabled(name))
+					continue;
+
+				AppearanceSolver s(kSize, kSize);
+				buildScene(s, mode, params);
+
+				std::vector<std::pair<ceres::CostFunction*, std::vector<double*>>> costs;
+				for (int p : s.domain)
+				{
+					s.visitResidualBlocks(p, params, [&](ceres::CostFunction* cost, const std::vector<double*>& blockParams) {
+						if (cost)
+							costs.emplace_back(cost, blockParams);
+					});
+					if (costs.size() >= 256)
+						break;
+				}
+
+				std::vector<double> residuals;
+				std::vector<std::vector<double>> jacobians;
+				std::vector<double*> jacobianPtrs;
+				run(name, "call", 1.0, [&]() {
+					for (auto& [cost, blockParams] : costs)
+						evaluateWithJacobians(cost, blockParams, residuals, jacobians, jacobianPtrs);
+					benchmarkSink = benchmarkSink + residuals[0];
+					return (double)costs.size();
+				});
+
+				for (auto& [cost, blockParams] : costs)
+					delete cost;
+			}
+		}
+	}
+
+	void benchSmoothCost()
+	{
+		std::vector<double> map(kSize * kSize);
+		std::mt19937 rng(13);
+		for (auto& value : map)
+			value = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+
+		for (int t = (int)SmoothType::MIN; t < (int)SmoothType::MAX; ++t)
+		{
+			SmoothType type = (SmoothType)t;
+			std::string name = "SmoothCost/" + toString(type);
+			if (!enabled(name))
+				continue;
+
+			std::vector<std::pair<ceres::CostFunction*, std::vector<double*>>> costs;
+			for (int y = kDomainStart; y < kDomainStart + kDomainSize; ++y)
+			{
+				std::vector<double*> blockParams;
+				ceres::CostFunction* cost = makeSmoothCost(type, &map[y * kSize + kDomainStart], 1, kSize, 0.5, 1.0, 0.1, blockParams);
+				costs.emplace_back(cost, blockParams);
+			}
+
+			std::vector<double> residuals;
+			std::vector<std::vector<double>> jacobians;
+			std::vector<double*> jacobianPtrs;
+			run(name, "call", 1.0, [&]() {
+				for (auto& [cost, blockParams] : costs)
+					evaluateWithJacobians(cost, blockParams, residuals, jacobians, jacobianPtrs);
+				benchmarkSink = benchmarkSink + residuals[0];
+				return (double)costs.size();
+			});
+
+			for (auto& [cost, blockParams] : costs)
+				delete cost;
+		}
+	}
+
+	void benchImages()
+	{
+		constexpr int kImageSize = 256;
+		const double numPixels = kImageSize * kImageSize;
+		auto dir = std::filesystem::temp_directory_path() / "facial_brdf_benchmark";
+		std::filesystem::create_directories(dir);
+
+		std::string binaryPath = (dir / "viewMap").string();
+		{
+			std::vector<float> texels(kImageSize * kImageSize * 4, 0.5f);
+			FILE* fp = fopen(binaryPath.c_str(), "wb");
+			fwrite(texels.data(), sizeof(float), texels.size(), fp);
+			fclose(fp);
+		}
+
+		run("readBinaryImage/float4_to_vector3d", "1000px", 1000.0, [&]() {
+			std::vector<Eigen::Vector3d> out;
+			readBinaryImage<float, 4, 3>(binaryPath, kImageSize, kImageSize, out);
+			benchmarkSink = benchmarkSink + out[0][0];
+			return numPixels;
+		});
+
+		std::vector<double> image(kImageSize * kImageSize * 3);
+		for (size_t i = 0; i < image.size(); ++i)
+			image[i] = (i % 251) / 250.0;
+		std::string imagePath = (dir / "image.jpg").string();
+
+		run("writeImage/rgb_jpg", "1000px", 1000.0, [&]() {
+			writeImage(imagePath, image.data(), kImageSize, kImageSize, 3);
+			return numPixels;
+		});
+
+		run("writeImage/rgb_srgb_jpg", "1000px", 1000.0, [&]() {
+			writeImage(imagePath, image.data(), kImageSize, kImageSize, 3, 0.0, 1.0, true);
+			return numPixels;
+		});
+
+		std::filesystem::remove_all(dir);
+	}
+
+	void benchCreateProblem()
+	{
+		for (NormalOptMode mode : { NormalOptMode::raw_normal, NormalOptMode::heightmap2020 })
+		{
+			std::string name = "createProblem/" + modeName(mode);
+			if (!enabled(name))
+				continue;
+
+			ParamSpace params = param_diffuse | param_specular | param_roughness | param_normal;
+			AppearanceSolver s(kSize, kSize);
+			buildScene(s, mode, params);
+			s.setSmoothCost(Param::diffuse, SmoothType::one, 0.5);
+			s.setSmoothCost(Param::roughness, SmoothType::one, 0.02);
+
+			run(name, "1000px", 1000.0, [&]() {
+				delete s.createProblem(params);
+				return (double)s.domain.area();
+			});
+		}
+	}
+
+public:
+	SolverBenchmark(std::string filter, double minTime)
+		: filter(std::move(filter)), minTime(minTime) {}
+
+	void runAll()
+	{
+		benchBRDF();
+		benchEvaluate();
+		benchAccuracyCost();
+		benchSmoothCost();
+		benchImages();
+		benchCreateProblem();
+	}
+
+	json toJson() const
+	{
+		json out;
+		out["context"] = {
+			{ "scene", { { "width", kSize }, { "height", kSize }, { "domain", kDomainSize * kDomainSize },
+				{ "lights", kNumLights }, { "views", kNumViews } } },
+			{ "min_time_s", minTime },
+			{ "hardware_threads", std::thread::hardware_concurrency() },
+		};
+		out["benchmarks"] = json::array();
+		for (const auto& result : results)
+		{
+			out["benchmarks"].push_back({
+				{ "name", result.name },
+				{ "iterations", result.iterations },
+				{ "ns_per_op", result.nsPerOp },
+				{ "unit", result.unit },
+			});
+		}
+		return out;
+	}
+};
+
+
+int main(int argc, char** argv)
+{
+	std::string filter;
+	std::string outPath = "benchmark.json";
+	double minTime = 0.2;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--filter" && i + 1 < argc)
+			filter = argv[++i];
+		else if (arg == "--min-time" && i + 1 < argc)
+			minTime = std::atof(argv[++i]);
+		else if (arg == "--out" && i + 1 < argc)
+			outPath = argv[++i];
+		else
+		{
+			fprintf(stderr, "usage: %s [--filter <substring>] [--min-time <seconds>] [--out <file.json>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	SolverBenchmark benchmark(filter, minTime);
+	benchmark.runAll();
+
+	std::string text = benchmark.toJson().dump(2);
+	if (outPath == "-")
+		printf("%s\n", text.c_str());
+	else
+		std::ofstream(outPath) << text << std::endl;
+	return 0;
+}
@@ -23,7 +23,7 @@ bool AppearanceSolver::AccuracyCost::operator()(Params* ... params) const
 	auto& view = solver.views[v];
 
 	Vec3 diffuse;
-	if (opt.params & ParamSpace::param_diffuse)
+	if (paramSpace & ParamSpace::param_diffuse)
 	{
 		diffuse = Vec3(*x[id + 0], *x[id + 1], *x[id + 2]);
 		id += 3;
@@ -33,21 +33,19 @@ bool AppearanceSolver::AccuracyCost::operator()(Params* ... params) const
 		diffuse = solver.diffuseMap[p].cast<T>();
 	}
 
-	T specular = (opt.params & ParamSpace::param_specular) ?
-		*x[id++] : T(solver.specularMap[p]);
+	T specular = (paramSpace & ParamSpace::param_specular) ?
+		*x[id++] : T(solver.specularMap[opt.constantSpecular ? 0 : p]);
 
-	T roughness = (opt.params & ParamSpace::param_roughness) ?
-		*x[id++] : T(solver.roughnessMap[p]);
+	T roughness = (paramSpace & ParamSpace::param_roughness) ?
+		*x[id++] : T(solver.roughnessMap[opt.constantRoughness ? 0 : p]);
 
 	Vec3 N;
-	if (!(opt.params & ParamSpace::param_normal))
+	if (!(paramSpace & ParamSpace::param_normal))
 	{
 		N = solver.normalMap[p].cast<T>();
 	}
 	else
 	{
-		Eigen::Matrix<T, 3, 3> tbnMat = solver.tbnMap[p].cast<T>();
-
 		if (opt.normalMode == NormalOptMode::raw_normal)
 		{
 			N = Eigen::Map<const Vec3>(x[id++]);
@@ -55,6 +53,7 @@ bool AppearanceSolver::AccuracyCost::operator()(Params* ... params) const
 
 		else if (opt.normalMode == NormalOptMode::raw_normal2D)
 		{
+			Eigen::Matrix<T, 3, 3> tbnMat = solver.tbnMatrix(p).cast<T>();
 			T U = *x[id++];
 			T V = *x[id++];
 
@@ -65,6 +64,7 @@ bool AppearanceSolver::AccuracyCost::operator()(Params* ... params) const
 		
 		else 
 		{
+			Eigen::Matrix<T, 3, 3> tbnMat = solver.tbnMatrix(p).cast<T>();
 			T du, dv;
 			if (opt.diffMode == DifferenceMode::forward) {
 				du = *x[id] - *x[id + 1];
@@ -96,17 +96,18 @@ bool AppearanceSolver::AccuracyCost::operator()(Params* ... params) const
 
 	Vec3 radiance = solver.evaluate(v, p, diffuse, specular, roughness, N);
 	
+	// Predictions are kept only for the views which are recorded.
 	if constexpr (!std::is_fundamental_v<T>)
 	{
-		if(radiance.isZero())
-			view.viewMap[p] = Eigen::Vector3d(0.0, 10000.0, 0.0);
-		else
-			view.viewMap[p] = Eigen::Vector3d(radiance[0].a, radiance[1].a, radiance[2].a);
+		if (!view.viewMap.empty())
+			view.viewMap[p] = radiance.isZero() ?
+				Eigen::Vector3d(0.0, 10000.0, 0.0) : Eigen::Vector3d(radiance[0].a, radiance[1].a, radiance[2].a);
 	}
 
-	x[id][0] = opt.channelWeight[0] * weight * (view.trgViewMap[p][0] - radiance[0]);
-	x[id][1] = opt.channelWeight[1] * weight * (view.trgViewMap[p][1] - radiance[1]);
-	x[id][2] = opt.channelWeight[2] * weight * (view.trgViewMap[p][2] - radiance[2]);
+	const Eigen::Vector3d target = view.trgViewMap[p];
+	x[id][0] = opt.channelWeight[0] * weight * (target[0] - radiance[0]);
+	x[id][1] = opt.channelWeight[1] * weight * (target[1] - radiance[1]);
+	x[id][2] = opt.channelWeight[2] * weight * (target[2] - radiance[2]);
 
 	return true;
 }
@@ -127,13 +128,13 @@ Eigen::Vector<T, 3> AppearanceSolver::evaluate(
 
 	T3 radiance = { T(0.0), T(0.0), T(0.0) };
 
+	uint scratch[ShadowTable::kMaxWords];
+	const uint* visibility = bUseShadow ? shadowTable.texel(pixelIdx, scratch) : nullptr;
+
 	for (int i = 0; i < lightSamples.size(); ++i)
 	{
 		const LightSample& sample = lightSamples[i];
-		int arrIdx = i / shadowPackSize;
-		int bitIdx = i % shadowPackSize;
-		bool visible = bUseShadow ? (shadowMaps[arrIdx][pixelIdx] & (1u << bitIdx)) : true;
-		if (!visible)
+		if (visibility && !(visibility[i / shadowPackSize] & (1u << (i % shadowPackSize))))
 			continue;
 
 		Eigen::Vector3d L = sample.position - P;
@@ -0,0 +1,161 @@
+#include "pch.h"
+#include "AppearanceSolver.h"
+#include "utils.h"
+
+
+// diffuse RGB, specular, roughness and the raw normal
+static constexpr int kMaxPixelScalars = 8;
+
+
+void AppearanceSolver::solveActiveSet(ParamSpace params, ceres::Problem* blockProblem)
+{
+	const auto& opt = problemOpts;
+	const int domainWidth = domain.ex - domain.sx;
+
+	// The scalars owned by pixel p, as blocks of the problem. Neighbouring heights belong to the neighbours.
+	auto pixelBlocks = [&](int p, std::vector<std::pair<double*, int>>& blocks) {
+		blocks.clear();
+		if (params & ParamSpace::param_diffuse)
+		{
+			blocks.emplace_back(diffuseMap[p].data() + 0, 1);
+			blocks.emplace_back(diffuseMap[p].data() + 1, 1);
+			blocks.emplace_back(diffuseMap[p].data() + 2, 1);
+		}
+		if ((params & ParamSpace::param_specular) && !opt.constantSpecular)
+			blocks.emplace_back(&specularMap[p], 1);
+		if ((params & ParamSpace::param_roughness) && !opt.constantRoughness)
+			blocks.emplace_back(&roughnessMap[p], 1);
+		if (params & ParamSpace::param_normal)
+		{
+			if (opt.normalMode == NormalOptMode::raw_normal)
+				blocks.emplace_back(normalMap[p].data(), 3);
+			else if (opt.normalMode == NormalOptMode::raw_normal2D)
+			{
+				blocks.emplace_back(sphereMap[p].data() + 0, 1);
+				blocks.emplace_back(sphereMap[p].data() + 1, 1);
+			}
+			else
+				blocks.emplace_back(&heightMap[p], 1);
+		}
+	};
+
+	std::vector<std::array<double, kMaxPixelScalars>> snapshot(domain.area());
+	std::vector<double> change(domain.area(), 0.0);
+	std::vector<uint8> frozen(domain.area(), 0);
+	std::vector<std::pair<double*, int>> blocks;
+
+	auto takeSnapshot = [&]() {
+		for (int p : domain)
+		{
+			int local = (p / width - domain.sy) * domainWidth + (p % width - domain.sx);
+			pixelBlocks(p, blocks);
+			int k = 0;
+			for (auto& [x, size] : blocks)
+				for (int c = 0; c < size; ++c)
+					snapshot[local][k++] = x[c];
+		}
+	};
+
+	auto setFrozen = [&](int p, bool bFrozen) {
+		pixelBlocks(p, blocks);
+		for (auto& [x, size] : blocks)
+		{
+			if (!blockProblem->HasParameterBlock(x))
+				continue;
+			if (bFrozen)
+				blockProblem->SetParameterBlockConstant(x);
+			else
+				blockProblem->SetParameterBlockVariable(x);
+		}
+	};
+
+	// The cost of the residual blocks of each pixel, so that a pixel whose residuals still drop stays active
+	// even when its parameters barely move.
+	auto evaluatePixelCosts = [&](std::vector<double>& costs) {
+		parallelFor(domain.sy, domain.ey, solverOptions.num_threads, [&](int i) {
+			std::vector<double> residuals;
+			for (int j = domain.sx; j < domain.ex; ++j)
+			{
+				double cost = 0.0;
+				visitResidualBlocks(i * width + j, params, [&](ceres::CostFunction* costFunction, const std::vector<double*>& blockParams) {
+					residuals.resize(costFunction->num_residuals());
+					costFunction->Evaluate(blockParams.data(), residuals.data(), nullptr);
+					for (double r : residuals)
+						cost += 0.5 * r * r;
+					delete costFunction;
+				});
+				costs[(i - domain.sy) * domainWidth + (j - domain.sx)] = cost;
+			}
+		});
+	};
+
+	std::vector<double> prevCost(domain.area()), cost(domain.area());
+	evaluatePixelCosts(prevCost);
+
+	const int maxIter = solverOptions.max_num_iterations;
+	const double initialRadius = solverOptions.initial_trust_region_radius;
+	int remaining = maxIter;
+
+	while (remaining > 0)
+	{
+		takeSnapshot();
+		setMaxNumIteration(_MIN(activeSetOpts.roundIters, remaining));
+		CeresSolver::solve(blockProblem);
+		remaining -= activeSetOpts.roundIters;
+		evaluatePixelCosts(cost);
+
+		for (int p : domain)
+		{
+			int local = (p / width - domain.sy) * domainWidth + (p % width - domain.sx);
+			pixelBlocks(p, blocks);
+			int k = 0;
+			change[local] = 0.0;
+			for (auto& [x, size] : blocks)
+				for (int c = 0; c < size; ++c)
+					change[local] = _MAX(change[local], std::abs(x[c] - snapshot[local][k++]));
+
+			if (prevCost[local] - cost[local] > activeSetOpts.tolerance * prevCost[local])
+				change[local] = _MAX(change[local], activeSetOpts.tolerance);
+		}
+		std::swap(prevCost, cost);
+
+		// A pixel stays active while it or one of its neighbours still moves, since their residuals are coupled.
+		int numActive = 0;
+		for (int i = domain.sy; i < domain.ey; ++i)
+			for (int j = domain.sx; j < domain.ex; ++j)
+		{
+			int local = (i - domain.sy) * domainWidth + (j - domain.sx);
+			bool moving = change[local] >= activeSetOpts.tolerance;
+			if (j > domain.sx)		moving |= change[local - 1] >= activeSetOpts.tolerance;
+			if (j + 1 < domain.ex)	moving |= change[local + 1] >= activeSetOpts.tolerance;
+			if (i > domain.sy)		moving |= change[local - domainWidth] >= activeSetOpts.tolerance;
+			if (i + 1 < domain.ey)	moving |= change[local + domainWidth] >= activeSetOpts.tolerance;
+
+			if (frozen[local] == moving)
+				setFrozen(i * width + j, !moving);
+			frozen[local] = !moving;
+			numActive += moving;
+		}
+
+		printf("Active set : %d / %d pixels\n", numActive, domain.area());
+		if (numActive == 0 || remaining <= 0 || bStopRequested)
+			break;
+
+		// The next round starts with an iteration 0 callback that would record the same state again,
+		// and continues from the trust region the previous round ended with.
+		--iterCount;
+		if (lastTrustRegionRadius > 0.0)
+			solverOptions.initial_trust_region_radius = lastTrustRegionRadius;
+	}
+
+	// Leave the problem as it was built, since the next run() may reuse it.
+	for (int p : domain)
+	{
+		int local = (p / width - domain.sy) * domainWidth + (p % width - domain.sx);
+		if (frozen[local])
+			setFrozen(p, false);
+	}
+
+	setMaxNumIteration(maxIter);
+	solverOptions.initial_trust_region_radius = initialRadius;
+}
@@ -3,14 +3,7 @@
 #include "utils.h"
 #include <random>
 #include <filesystem>
-
-
-template <typename _SrcType, int _srcComp, int _trgComp = _srcComp>
-struct ReadInfo {
-	using SrcType = _SrcType;
-	constexpr static int srcComp = _srcComp;
-	constexpr static int trgComp = _trgComp;
-};
+#include <sstream>
 
 
 void AppearanceSolver::printConfigurations()
@@ -19,8 +12,9 @@ void AppearanceSolver::printConfigurations()
 	{
 		if (isEnabled(view.cameraId) && isImaging(view.cameraId))
 		{
+			auto trgViewMap = view.trgViewMap.toVector(width * height);
 			writeImage(pathInfo.outDir + "view" + std::to_string(view.cameraId) + "_1000" + ".jpg",
-				(double*)view.trgViewMap.data(), width, height, 3, 0.0, recordOpts.maxView);
+				(double*)trgViewMap.data(), width, height, 3, 0.0, recordOpts.maxView);
 		}
 	}
 
@@ -41,6 +35,8 @@ void AppearanceSolver::printConfigurations()
 	fprintf(fp, "View weight bias    :  %g\n", opt.viewWeightBias);
 	fprintf(fp, "Zero radius         :  %d\n", opt.zeroRadius);
 	fprintf(fp, "Channel weight      :  [%g, %g, %g]\n", opt.channelWeight[0], opt.channelWeight[1], opt.channelWeight[2]);
+	if (pyramidOpts.numLevels > 1)
+		fprintf(fp, "Pyramid levels      :  %d (%d iterations per level)\n", pyramidOpts.numLevels, pyramidOpts.maxIterPerLevel);
 
 	if (opt.params & ParamSpace::param_normal)
 	{
@@ -192,7 +188,16 @@ void AppearanceSolver::printConfigurations()
 
 	
 
-	fprintf(fp, "Max Iterations      :  %d\n\n", solverOptions.max_num_iterations);
+	if (scheduleOpts.mode == SolveSchedule::joint && !problem && pixelParams())
+		fprintf(fp, "Solver engine       :  %s\n", resolveEngine(pixelParams()) == SolverEngine::matrixFree ? "matrix-free" : "local");
+
+	if (constantProblem)
+		fprintf(fp, "Constant solve      :  two-level (%d cycles, 1 of %dx%d pixels)\n", constantOpts.numCycles, constantOpts.sampleStride, constantOpts.sampleStride);
+
+	if (scheduleOpts.mode == SolveSchedule::alternating)
+		fprintf(fp, "Schedule            :  alternating (%d cycles, %d iterations per block)\n\n", scheduleOpts.numCycles, scheduleOpts.maxIterPerBlock);
+	else
+		fprintf(fp, "Max Iterations      :  %d\n\n", solverOptions.max_num_iterations);
 	fprintf(fp, "-------------Now, Solve!-------------\n");
 	fclose(fp);
 }
@@ -200,90 +205,126 @@ void AppearanceSolver::printConfigurations()
 
 ceres::CallbackReturnType AppearanceSolver::operator()(const ceres::IterationSummary& summary)
 {
-	printf("%d'th iteration has passed, and %d seconds has passed during the iteration.\n", ++iterCount, (clock() - lastTime) / CLOCKS_PER_SEC);
+	traceIterationEnd();
+	TRACE_SCOPE("iteration callback");
 
-	if(iterCount%2 == 1)
-	{
-		std::string iter = recordOpts.recordIterSeparately ? ("_" + std::to_string(iterCount)) : "";
+	auto now = std::chrono::steady_clock::now();
+	double iterSeconds = std::chrono::duration<double>(now - lastTime).count();
+	double runSeconds = std::chrono::duration<double>(now - runStart).count();
+	printf("%d'th iteration has passed, and %.1f seconds has passed during the iteration.\n", ++iterCount, iterSeconds);
+	++runIterations;
+	lastCost = summary.cost;
+	lastTrustRegionRadius = summary.trust_region_radius;
 
-		auto makePath = [&](std::string&& name, std::string&& name2="") {
-			return pathInfo.outDir + name + iter + name2 + ".jpg";
-		};
+	bool bOverBudget = budgetOpts.timeBudget > 0.0 && runSeconds >= budgetOpts.timeBudget;
+	bool bCancelled = budgetOpts.cancelToken && budgetOpts.cancelToken->load();
+	bStopRequested |= bOverBudget || bCancelled;
 
-		if (problemOpts.params & ParamSpace::param_diffuse)
-		{
-			writeImage(makePath("predicted_diffuse_srgb"),
-				(double*)diffuseMap.data(), width, height, 3, 0.0, 1.0, true);
-			writeImage(makePath("predicted_diffuse"),
-				(double*)diffuseMap.data(), width, height, 3, 0.0, 1.0, false);
-		}
+	const int interval = recordOpts.interval;
+	if ((interval > 0 && iterCount % interval == interval - 1) || bStopRequested)
+		recordIteration();
 
-		if (problemOpts.params & ParamSpace::param_specular)
-		{
-			if (!problemOpts.constantSpecular)
-			{
-				writeImage(makePath("predicted_specular"),
-					specularMap.data(), width, height, 1, 0.0, recordOpts.maxSpecular);
-			}
-		}
+	FILE* fp = fopen((pathInfo.outDir + pathInfo.loggingfile).c_str(), "a");
+	fprintf(fp, "Iter %d :\n", iterCount);
+	if (problemOpts.constantSpecular)  fprintf(fp, "\tConstantSpecular    :  %lf\n", specularMap[0]);
+	if (problemOpts.constantRoughness) fprintf(fp, "\tConstantRoughness   :  %lf\n", roughnessMap[0]);
+	if (bStopRequested)
+		fprintf(fp, "Stopped at iteration %d after %.1f seconds (%s), cost = %e\n",
+			iterCount, runSeconds, bCancelled ? "cancelled" : "time budget", summary.cost);
+	fclose(fp);
 
-		if (problemOpts.params & ParamSpace::param_roughness)
+	if (checkpointOpts.interval > 0 && iterCount > 0 && (iterCount % checkpointOpts.interval == 0 || bStopRequested))
+		writeCheckpoint(summary.trust_region_radius);
+
+	lastTime = std::chrono::steady_clock::now();
+	traceIterationBegin();
+	return bStopRequested ? ceres::SOLVER_TERMINATE_SUCCESSFULLY : ceres::SOLVER_CONTINUE;
+}
+
+
+void AppearanceSolver::recordIteration()
+{
+	const RecordMaps maps = recordOpts.maps;
+	std::string iter = recordOpts.recordIterSeparately ? ("_" + std::to_string(iterCount)) : "";
+
+	if (!imageWriter)
+		imageWriter = new ImageWriter(recordOpts.numWriters, 4 * recordOpts.numWriters);
+
+	// Snapshots alternate between two buffers, so the solver waits only when the previous two are still being written.
+	const int buffer = numSnapshots++ % 2;
+	imageWriter->wait(buffer);
+	auto& planes = snapshots[buffer];
+	size_t numPlanes = 0;
+
+	auto record = [&](const std::string& name, const double* src, int channels, double min, double max, std::vector<bool> srgb = { false }) {
+		if (planes.size() <= numPlanes)
+			planes.emplace_back();
+		std::vector<double>& plane = planes[numPlanes++];
+		plane.assign(src, src + (size_t)width * height * channels);
+
+		for (bool bSrgb : srgb)
 		{
-			if (!problemOpts.constantRoughness)
-			{
-				writeImage(makePath("predicted_roughness"),
-					roughnessMap.data(), width, height, 1, 0.0, recordOpts.maxRoughness);
-			}
+			std::string path = pathInfo.outDir + name + (bSrgb ? "_srgb" : "") + iter + ".jpg";
+			imageWriter->submit([this, &plane, path, channels, min, max, bSrgb]() {
+				writeImage(path, plane.data(), width, height, channels, min, max, bSrgb);
+			}, buffer);
 		}
 
-		if (problemOpts.params & ParamSpace::param_normal)
+		if (recordOpts.bFloatOutput)
 		{
-			if (problemOpts.normalMode != NormalOptMode::raw_normal)
-			{
-				if (problemOpts.normalMode != NormalOptMode::raw_normal2D)
-					writeImage(makePath("predicted_height"),
-						heightMap.data(), width, height, 1, -recordOpts.maxHeight, recordOpts.maxHeight);
-				constructNormal();
-			}
-			writeImage(makePath("predicted_normal"),
-				(double*)normalMap.data(), width, height, 3, -1.0, 1.0);
+			std::string path = pathInfo.outDir + name + iter + ".pfm";
+			imageWriter->submit([this, &plane, path, channels]() {
+				writeFloatImage(path, plane.data(), width, height, channels);
+			}, buffer);
 		}
+	};
+
+	if ((problemOpts.params & ParamSpace::param_diffuse) && (maps & record_diffuse))
+		record("predicted_diffuse", (double*)diffuseMap.data(), 3, 0.0, 1.0, { true, false });
+
+	if ((problemOpts.params & ParamSpace::param_specular) && !problemOpts.constantSpecular && (maps & record_specular))
+		record("predicted_specular", specularMap.data(), 1, 0.0, recordOpts.maxSpecular);
+
+	if ((problemOpts.params & ParamSpace::param_roughness) && !problemOpts.constantRoughness && (maps & record_roughness))
+		record("predicted_roughness", roughnessMap.data(), 1, 0.0, recordOpts.maxRoughness);
 
+	if (problemOpts.params & ParamSpace::param_normal)
+	{
+		if (!heightMap.empty() && (maps & record_height))
+			record("predicted_height", heightMap.data(), 1, -recordOpts.maxHeight, recordOpts.maxHeight);
+
+		if (problemOpts.normalMode != NormalOptMode::raw_normal)
+			constructNormal();
+		if (maps & record_normal)
+			record("predicted_normal", (double*)normalMap.data(), 3, -1.0, 1.0);
+	}
+
+	if (maps & record_views)
+	{
 		constructView();
 
 		for (auto& view : views)
 		{
 			if (isEnabled(view.cameraId) && isImaging(view.cameraId))
 			{
-				writeImage(makePath("view" + std::to_string(view.cameraId)),
-					(double*)view.viewMap.data(), width, height, 3, 0.0, recordOpts.maxView);
-				writeImage(makePath("view" + std::to_string(view.cameraId) + "err"),
-					(double*)view.errorMap.data(), width, height, 3, 0.0, recordOpts.maxView * 0.1);
+				record("view" + std::to_string(view.cameraId),
+					(double*)view.viewMap.data(), 3, 0.0, recordOpts.maxView);
+				record("view" + std::to_string(view.cameraId) + "err",
+					(double*)view.errorMap.data(), 3, 0.0, recordOpts.maxView * 0.1);
 			}
 		}
 	}
-
-	FILE* fp = fopen((pathInfo.outDir + pathInfo.loggingfile).c_str(), "a");
-	fprintf(fp, "Iter %d :\n", iterCount);
-	if (problemOpts.constantSpecular)  fprintf(fp, "\tConstantSpecular    :  %lf\n", specularMap[0]);
-	if (problemOpts.constantRoughness) fprintf(fp, "\tConstantRoughness   :  %lf\n", roughnessMap[0]);
-	fclose(fp);
-
-	lastTime = clock();
-	return ceres::CallbackReturnType::SOLVER_CONTINUE;
 }
 
 
 AppearanceSolver::AppearanceSolver(int width, int height)
 	: width(width), height(height) 
 {
+	// The height, sphere and TBN maps are allocated by prepareInputs() when the run needs them.
 	diffuseMap.resize(width * height, { 0.0, 0.0, 0.0 });
 	specularMap.resize(width * height, defaultSpecular);
 	roughnessMap.resize(width * height, defaultRoughness);
-	heightMap.resize(width * height, 0.0);						
-	sphereMap.resize(width * height, { 0.0, 0.0 });
 	normalMap.resize(width * height);
-	tbnMap.resize(width * height);
 	
 	problemOpts.base[(int)Param::diffuseR] = 0.0;
 	problemOpts.base[(int)Param::diffuseG] = 0.0;
@@ -299,50 +340,71 @@ AppearanceSolver::AppearanceSolver(int width, int height)
 }
 
 
+AppearanceSolver::~AppearanceSolver()
+{
+	if (checkpointWriter.joinable())
+		checkpointWriter.join();
+	delete imageWriter;
+
+	for (auto& [params, blockProblem] : blockProblems)
+		delete blockProblem;
+	delete constantProblem;
+}
+
+
 bool AppearanceSolver::loadInputData(std::ostream& log)
 {
+	TRACE_SCOPE("loadInputData");
 	printf("Loading input data...\n");
-	
-	lightSamples.clear();
-	positionMap.clear();
-	geoNormalMap.clear();
-	views.clear();
-	shadowMaps.clear();
 
-	auto clear = [](auto& container) {
-		container.clear();
-		container.shrink_to_fit();
-	};
+	if (!loadRigData(log) || !loadFrameData(log))
+		return false;
 
-	auto readBinary = [&](auto staticInfo, std::string& fileName, auto& out) {
-		try
+	normalMap = geoNormalMap.toVector(width * height);
+
+	return true;
+}
+
+
+bool AppearanceSolver::loadRigData(std::ostream& log)
+{
+	lightSamples.clear();
+	rigCameras.clear();
+
+	auto container = openContainer(log);
+	auto readText = [&](const std::string& fileName, std::string& text) {
+		if (container)
 		{
-			using Info = std::decay_t<decltype(staticInfo)>;
-			readBinaryImage<Info::SrcType, Info::srcComp, Info::trgComp>(pathInfo.inDir + fileName, width, height, out);
-			log << "-> The corresponding map is generated from the file: " << fileName << std::endl;
+			if (!container->hasPlane(fileName))
+				return false;
+			text = container->readBlob(fileName);
 			return true;
 		}
-		catch (std::runtime_error& e)
-		{
-			log << "-> " << e.what() << ": " << pathInfo.inPositionMap << std::endl;
+		std::ifstream file(pathInfo.inDir + fileName, std::ios::binary);
+		if (!file)
 			return false;
-		}
+		text.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		return true;
 	};
-	
 
-	bool success = true;
-	int numLightSamples = 0;
-
-	if (std::ifstream lightFile(pathInfo.inDir + pathInfo.inLightSampleInfo); !lightFile)
+	std::string lightText;
+	std::string cameraText;
+	if (!readText(pathInfo.inLightSampleInfo, lightText))
 	{
 		log << "-> Failed to read file: " << pathInfo.inLightSampleInfo << std::endl;
-		success = false;
+		return false;
 	}
-	else
+	if (!readText(pathInfo.inCameraInfo, cameraText))
+		log << "-> Failed to read file: " << pathInfo.inCameraInfo << std::endl;
+
+	// Parsing the rig is skipped when its tables are cached for the same files.
+	uint64 rigKey = hashBytes(cameraText.data(), cameraText.size(), hashBytes(lightText.data(), lightText.size()));
+	if (loadCachedRig(rigKey))
+		return true;
+
 	{
-		auto sampleInfo = json::parse(lightFile)["Samples"];
-		numLightSamples = (int) sampleInfo.size();
-		lightSamples.reserve(numLightSamples);
+		auto sampleInfo = json::parse(lightText)["Samples"];
+		lightSamples.reserve(sampleInfo.size());
 		for (const auto& sample : sampleInfo)
 		{
 			LightSample l;
@@ -356,99 +418,185 @@ bool AppearanceSolver::loadInputData(std::ostream& log)
 		}
 	}
 
-	if (!success)
+	if (!cameraText.empty())
 	{
-		lightSamples.clear();
-		return false;
+		auto cameraInfo = json::parse(cameraText);
+
+		assert(cameraInfo["Coordinates"] == "Unreal");
+		
+		for (const auto& camera : cameraInfo["Poses"])
+		{
+			Eigen::Vector3d cameraPos = {
+				-(double)camera["position"][0],
+				(double)camera["position"][2],
+				(double)camera["position"][1] };
+			rigCameras.emplace_back(camera["id"], cameraPos);
+		}
 	}
-	else
-	{
-		int numMaps = (numLightSamples + shadowPackSize - 1) / shadowPackSize;
-		size_t pos = pathInfo.inShadowMaps.find_last_of('$');
-		shadowMaps.resize(numMaps);
 
-		for (int i = 0; i < numMaps; ++i)
+	saveCachedRig(rigKey);
+	return true;
+}
+
+
+bool AppearanceSolver::loadFrameData(std::ostream& log)
+{
+	TRACE_SCOPE("loadFrameData");
+	positionMap.clear();
+	geoNormalMap.clear();
+	views.clear();
+	viewMasks.clear();
+	shadowTable.clear();
+
+	auto clear = [](auto& container) {
+		container.clear();
+		container.shrink_to_fit();
+	};
+
+	// Separate map files are mapped rather than read, and the rows of the window are paged in right away by the
+	// loading task. The planes of a container are decoded instead.
+	auto container = openContainer(log);
+	auto window = inputWindow();
+	loadedWindow = window;
+	auto mapBinary = [&](std::string& fileName, auto& out, std::ostream& log) {
+		try
 		{
-			std::string inShadowMap = pathInfo.inShadowMaps;
-			inShadowMap.replace(pos, 1, std::to_string(i + 1));
-			if (!readBinary(ReadInfo<uint, 1>(), inShadowMap, shadowMaps[i]))
+			if (container)
+				container->readPlane(fileName, out, window[0], window[1], window[2], window[3]);
+			else
 			{
-				log << "---> All Shadow maps are being discarded !!" << std::endl;
-				clear(shadowMaps);
-				break;
+				mapBinaryImage(pathInfo.inDir + fileName, width, height, out, window[0], window[1]);
+				touchPages(out.data(), out.size() * sizeof(*out.data()));
 			}
+			log << "-> The corresponding map is generated from the file: " << fileName << std::endl;
+			return true;
+		}
+		catch (std::runtime_error& e)
+		{
+			log << "-> " << e.what() << ": " << fileName << std::endl;
+			return false;
+		}
+	};
+
+	// Independent maps are loaded concurrently, and their log lines are written in order afterwards.
+	using LoadTask = std::function<bool(std::ostream&)>;
+	auto runTasks = [&](const std::vector<LoadTask>& tasks) {
+		std::vector<std::ostringstream> logs(tasks.size());
+		std::vector<uint8> loaded(tasks.size(), 0);
+		parallelFor(0, (int)tasks.size(), solverOptions.num_threads, [&](int i) {
+			loaded[i] = tasks[i](logs[i]);
+		});
+		for (auto& taskLog : logs)
+			log << taskLog.str();
+		return loaded;
+	};
+
+	int numLightSamples = (int)lightSamples.size();
+	int numMaps = (numLightSamples + shadowPackSize - 1) / shadowPackSize;
+	std::vector<SharedMap<uint>> shadowMaps(numMaps);
+
+	std::vector<LoadTask> tasks;
+	{
+		size_t pos = pathInfo.inShadowMaps.find_last_of('$');
+		for (int i = 0; i < numMaps; ++i)
+		{
+			tasks.push_back([&, i, pos](std::ostream& taskLog) {
+				std::string inShadowMap = pathInfo.inShadowMaps;
+				inShadowMap.replace(pos, 1, std::to_string(i + 1));
+				return mapBinary(inShadowMap, shadowMaps[i], taskLog);
+			});
 		}
 	}
+	tasks.push_back([&](std::ostream& taskLog) { return mapBinary(pathInfo.inPositionMap, positionMap, taskLog); });
+	tasks.push_back([&](std::ostream& taskLog) { return mapBinary(pathInfo.inNormalMap, geoNormalMap, taskLog); });
 
-	success &= readBinary(ReadInfo<float, 4, 3>(), pathInfo.inPositionMap, positionMap);
-	success &= readBinary(ReadInfo<float, 4, 3>(), pathInfo.inNormalMap, geoNormalMap);
+	auto loaded = runTasks(tasks);
 
-	if (!success)
+	if (std::find(loaded.begin(), loaded.begin() + numMaps, 0) != loaded.begin() + numMaps)
 	{
-		clear(lightSamples);
-		clear(positionMap);
-		clear(geoNormalMap);
-		return false;
+		log << "---> All Shadow maps are being discarded !!" << std::endl;
+		shadowMaps.clear();
 	}
 
-	int nFailed = 0;
+	// The shadow maps are transposed so that the visibility of a texel is contiguous, and the files are released.
+	shadowTable.build(shadowMaps, solverOptions.num_threads);
+	shadowMaps.clear();
+	if (storageOpts.bCompressedShadows)
+		shadowTable.compress(solverOptions.num_threads);
 
-	if (std::ifstream cameraFile(pathInfo.inDir + pathInfo.inCameraInfo); !cameraFile)
+	if (!loaded[numMaps] || !loaded[numMaps + 1])
 	{
-		log << "-> Failed to read file: " << pathInfo.inCameraInfo << std::endl;
+		clear(lightSamples);
+		positionMap.clear();
+		geoNormalMap.clear();
+		return false;
 	}
-	else
+
+	// The TBN matrices only need the geometry, so they are computed while the views are loaded.
+	std::thread tbnWorker([this]() { computeTBNMatrix(); });
+
+	std::vector<ViewData> viewData(rigCameras.size());
+	tasks.clear();
 	{
-		auto cameraInfo = json::parse(cameraFile);
 		size_t vPos = pathInfo.inViewMaps.find_last_of('$');
 		size_t wPos = pathInfo.inWeightMaps.find_last_of('$');
 
-		assert(cameraInfo["Coordinates"] == "Unreal");
-		
-		for (const auto& camera : cameraInfo["Poses"])
+		for (int v = 0; v < (int)rigCameras.size(); ++v)
 		{
-			ViewData viewData;
-			viewData.cameraId = camera["id"];
-			viewData.cameraPos = {
-				-(double)camera["position"][0],
-				(double)camera["position"][2],
-				(double)camera["position"][1] };
-
-			std::string inViewMap = pathInfo.inViewMaps;
-			inViewMap.replace(vPos, 1, std::to_string(viewData.cameraId));
-			if (!readBinary(ReadInfo<float, 4, 3>(), inViewMap, viewData.trgViewMap))
-			{
-				nFailed++;
-				continue;
-			}
-
-			std::string inWeightMap = pathInfo.inWeightMaps;
-			inWeightMap.replace(wPos, 1, std::to_string(viewData.cameraId));
-			if (!readBinary(ReadInfo<float, 1>(), inWeightMap, viewData.weightMap))
-			{
-				nFailed++;
-				continue;
-			}
+			viewData[v].cameraId = rigCameras[v].first;
+			viewData[v].cameraPos = rigCameras[v].second;
+
+			tasks.push_back([&, v, vPos](std::ostream& taskLog) {
+				std::string inViewMap = pathInfo.inViewMaps;
+				inViewMap.replace(vPos, 1, std::to_string(viewData[v].cameraId));
+				if (!mapBinary(inViewMap, viewData[v].trgViewMap.stored(), taskLog))
+					return false;
+				if (storageOpts.bHalfViews)
+					viewData[v].trgViewMap.reducePrecision();
+				return true;
+			});
+			tasks.push_back([&, v, wPos](std::ostream& taskLog) {
+				std::string inWeightMap = pathInfo.inWeightMaps;
+				inWeightMap.replace(wPos, 1, std::to_string(viewData[v].cameraId));
+				if (!mapBinary(inWeightMap, viewData[v].weightMap.stored(), taskLog))
+					return false;
+				if (storageOpts.bHalfViews)
+					viewData[v].weightMap.reducePrecision();
+				return true;
+			});
+		}
+	}
 
-			viewData.viewMap.resize(width * height, Eigen::Vector3d(0.0, 0.0, 0.0));
-			viewData.errorMap.resize(width * height, Eigen::Vector3d(0.0, 0.0, 0.0));
+	loaded = runTasks(tasks);
+	tbnWorker.join();
 
-			views.push_back(std::move(viewData));
+	int nFailed = 0;
+	for (int v = 0; v < (int)viewData.size(); ++v)
+	{
+		if (!loaded[2 * v] || !loaded[2 * v + 1])
+		{
+			nFailed++;
+			continue;
 		}
+
+		views.push_back(std::move(viewData[v]));
 	}
 
 	if (views.size() == 0)
 	{
 		clear(lightSamples);
-		clear(positionMap);
-		clear(geoNormalMap);
+		positionMap.clear();
+		geoNormalMap.clear();
 		return false;
 	}
 
 	if (nFailed > 0)
 		log << "[WARNING] " << nFailed << " captured images cannot be read." << std::endl;
-	
-	normalMap = geoNormalMap;
+
+	// The solved maps carry over to a warm frame, but a normal map that is not solved follows the new geometry.
+	if (!normalMap.empty() && !(problemOpts.params & ParamSpace::param_normal))
+		for (int p : domain)
+			normalMap[p] = geoNormalMap[p];
 
 	return true;
 }
@@ -456,6 +604,7 @@ bool AppearanceSolver::loadInputData(std::ostream& log)
 
 void AppearanceSolver::resetSolution()
 {
+	TRACE_SCOPE("resetSolution");
 	std::mt19937 rng;
 	std::uniform_real_distribution<double> distrb(0.0, 1.0);
 
@@ -464,11 +613,16 @@ void AppearanceSolver::resetSolution()
 		diffuseMap[p] = { distrb(rng), distrb(rng), distrb(rng) };
 		specularMap[p] = defaultSpecular;
 		roughnessMap[p] = defaultRoughness;
-		heightMap[p] = 0.0;
-		sphereMap[p] = Eigen::Vector2d(0.0, 0.0);
 		normalMap[p] = geoNormalMap[p];
 	}
 
+	if (!heightMap.empty())
+		for (int p : domain)
+			heightMap[p] = 0.0;
+	if (!sphereMap.empty())
+		for (int p : domain)
+			sphereMap[p] = Eigen::Vector2d(0.0, 0.0);
+
 	specularMap[0] = defaultSpecular;
 	roughnessMap[0] = defaultRoughness;
 
@@ -476,39 +630,152 @@ void AppearanceSolver::resetSolution()
 }
 
 
-void AppearanceSolver::run()
+bool AppearanceSolver::prepareInputs()
 {
-	if (!std::filesystem::exists(pathInfo.outDir))
-	{
-		std::filesystem::create_directories(pathInfo.outDir);
-	}
+	// Loading the frame computes the TBN matrices as well, unless a resumed checkpoint changes the domain or the modes.
+	bool bTBNLoaded = false;
+	if (allocateMaps())
+		changeState(invalidTBN);
 
 	if (solverState <= invalidInputData) {
-		if (!loadInputData())
+		bool bWarmFrame = bFrameReload;
+		bFrameReload = false;
+
+		if (bWarmFrame ? !loadFrameData() : !loadInputData())
 		{
 			printf("The \'solverState\' is \'invalidInputData\', but failed to load input data!!\n");
-			return;
+			return false;
 		}
+
+		// A new frame of a sequence starts from the solution of the previous one.
+		if (bWarmFrame)
+			solverState = invalidTBN;
+		bTBNLoaded = true;
 	}
 
 	if (solverState <= invalidSolution) {
-		resetSolution();
+		if (checkpointOpts.loadPath.empty() || !loadCheckpoint())
+		{
+			resetSolution();
+			if (pyramidOpts.numLevels > 1)
+				solveCoarseLevels();
+		}
+		else
+		{
+			// The checkpoint holds only the maps of its own run, and a resume may change the modes as well.
+			allocateMaps();
+			if (checkpointOpts.bResume)
+				bTBNLoaded = false;
+
+			// A resumed domain may reach beyond the rows of a cropped input.
+			if (!inputCoversDomain() && !loadFrameData())
+				return false;
+		}
+		checkpointOpts.loadPath.clear();
 		solverState = invalidTBN;
 	}
 
-	if (solverState <= invalidHeight) {
+	bool bIntegrateHeight = false;
+	if (solverState <= invalidHeight && !heightMap.empty()) {
 		for (int p : domain) 
 			heightMap[p] = 0.0;
+		bIntegrateHeight = bHeightFromNormal;
 	}
 
-	if (solverState <= invalidTBN)
+	if (solverState <= invalidTBN && !bTBNLoaded)
 		computeTBNMatrix();
 
+	if (bIntegrateHeight)
+		integrateHeight();
+
+	allocateViewMaps();
+	prepareViewMasks();
+
+	if (solverState < invalidProblem)
+		solverState = invalidProblem;
+	return true;
+}
+
+
+// Returns true when the TBN map has just been allocated, and has to be computed.
+bool AppearanceSolver::allocateMaps()
+{
+	auto release = [](auto& container) {
+		container.clear();
+		container.shrink_to_fit();
+	};
+
+	if (!usesHeightMap())
+		release(heightMap);
+	else if (heightMap.empty())
+		heightMap.resize(width * height, 0.0);
+
+	if (!usesSphereMap())
+		release(sphereMap);
+	else if (sphereMap.empty())
+		sphereMap.resize(width * height, { 0.0, 0.0 });
+
+	if (!usesTBNMap())
+		tbnMap.clear();
+	else if (tbnMap.empty())
+	{
+		tbnMap.edit().resize(width * height);
+		return true;
+	}
+	return false;
+}
+
+
+// Predicted and error views exist only for the views which are recorded.
+void AppearanceSolver::allocateViewMaps()
+{
+	for (auto& view : views)
+	{
+		if (isEnabled(view.cameraId) && isImaging(view.cameraId))
+		{
+			view.viewMap.resize(width * height, Eigen::Vector3d(0.0, 0.0, 0.0));
+			view.errorMap.resize(width * height, Eigen::Vector3d(0.0, 0.0, 0.0));
+		}
+		else
+		{
+			view.viewMap.clear();
+			view.viewMap.shrink_to_fit();
+			view.errorMap.clear();
+			view.errorMap.shrink_to_fit();
+		}
+	}
+}
+
+
+void AppearanceSolver::run()
+{
+	if (!std::filesystem::exists(pathInfo.outDir))
+	{
+		std::filesystem::create_directories(pathInfo.outDir);
+	}
+
+	runStart = std::chrono::steady_clock::now();
+	bStopRequested = false;
+	TRACE_THREAD("solver");
+
+	// Parameter blocks are copied back into the maps at every iteration only when a callback reads them there.
+	solverOptions.update_state_every_iteration = recordOpts.interval > 0 || checkpointOpts.interval > 0 ||
+		budgetOpts.timeBudget > 0.0 || budgetOpts.cancelToken != nullptr;
+
+	// A resumed checkpoint lowers the iteration limit to what its run had left, for this run only.
+	const int maxIter = solverOptions.max_num_iterations;
+	if (!prepareInputs())
+	{
+		setMaxNumIteration(maxIter);
+		return;
+	}
+	runIterLimit = iterCount + 1 + solverOptions.max_num_iterations;
+
 	if (solverState <= invalidProblem)
 		createProblem();
 
 	recordOpts.maxHeight = (problemOpts.normalMode == NormalOptMode::heightmap2018) ? 3.0 : 0.1;
-	bUseShadow = problemOpts.bActiveShadow && shadowMaps.size() > 0;
+	bUseShadow = problemOpts.bActiveShadow && !shadowTable.empty();
 	solverState = solvable;
 
 	if (recordOpts.writeVisibility) {
@@ -518,12 +785,26 @@ void AppearanceSolver::run()
 
 	printConfigurations();
 
-	lastTime = clock();
-	CeresSolver::solve();
+	lastTime = std::chrono::steady_clock::now();
+	runIterations = 0;
+	if (constantProblem)
+		solveTwoLevel();
+	else if (scheduleOpts.mode == SolveSchedule::alternating)
+		solveAlternating();
+	else
+		solveBlock(problemOpts.params, problem);
 	--iterCount;
 
+	if (checkpointWriter.joinable())
+		checkpointWriter.join();
+	if (imageWriter)
+		imageWriter->flush();
+
 	FILE* fp = fopen((pathInfo.outDir + pathInfo.loggingfile).c_str(), "a");
-	fprintf(fp, "-------All Iteration Complete!-------\n\n");
+	if (bStopRequested)
+		fprintf(fp, "-------Stopped Before Completion!-------\n\n");
+	else
+		fprintf(fp, "-------All Iteration Complete!-------\n\n");
 	fclose(fp);
 
 	if (problemOpts.constantSpecular || problemOpts.constantRoughness)
@@ -537,17 +818,134 @@ void AppearanceSolver::run()
 				roughnessMap[p] = roughnessMap[0];
 		}
 	}
+
+	if (recordOpts.bFloatOutput)
+		writeResults();
+
+	setMaxNumIteration(maxIter);
+	TRACE_WRITE(pathInfo.outDir + pathInfo.traceFile);
+}
+
+
+void AppearanceSolver::writeResults()
+{
+	auto write = [this](const std::string& name, const double* src, int channels) {
+		if (!writeFloatImage(pathInfo.outDir + name + ".pfm", src, width, height, channels))
+			printf("[WARNING] Failed to write the result: %s.pfm\n", name.c_str());
+	};
+
+	if (problemOpts.params & ParamSpace::param_normal && problemOpts.normalMode != NormalOptMode::raw_normal)
+		constructNormal();
+
+	write(pathInfo.outDiffuseMap, (double*)diffuseMap.data(), 3);
+	write(pathInfo.outSpecularMap, specularMap.data(), 1);
+	write(pathInfo.outRoughnessMap, roughnessMap.data(), 1);
+	write(pathInfo.outNormalMap, (double*)normalMap.data(), 3);
+	if (!heightMap.empty())
+		write(pathInfo.outHeightMap, heightMap.data(), 1);
+	if (!sphereMap.empty())
+		write(pathInfo.outSphereMap, (double*)sphereMap.data(), 2);
+}
+
+
+// Maps missing from the directory, or not matching this solver, keep their reset values.
+bool AppearanceSolver::loadResults(const std::string& dir)
+{
+	std::string root = (dir.back() == '/' || dir.back() == '\\') ? dir : dir + '/';
+	printf("Loading the results in %s\n", root.c_str());
+
+	resetSolution();
+
+	int numLoaded = 0;
+	auto read = [&](const std::string& name, double* out, int channels) {
+		if (readFloatImage(root + name + ".pfm", width, height, channels, out))
+			++numLoaded;
+	};
+
+	read(pathInfo.outDiffuseMap, (double*)diffuseMap.data(), 3);
+	read(pathInfo.outSpecularMap, specularMap.data(), 1);
+	read(pathInfo.outRoughnessMap, roughnessMap.data(), 1);
+	read(pathInfo.outNormalMap, (double*)normalMap.data(), 3);
+	if (!heightMap.empty())
+		read(pathInfo.outHeightMap, heightMap.data(), 1);
+	if (!sphereMap.empty())
+		read(pathInfo.outSphereMap, (double*)sphereMap.data(), 2);
+
+	if (numLoaded == 0)
+	{
+		printf("[WARNING] No result is found, and the solution is reset instead.\n");
+		return false;
+	}
+	return true;
+}
+
+
+void AppearanceSolver::solveBlock(ParamSpace params, ceres::Problem* blockProblem)
+{
+	if (blockProblem)
+	{
+		// The grid ordering applies to this solve only, and the linear solver set by the caller is restored after it.
+		auto linearSolverType = solverOptions.linear_solver_type;
+		auto linearSolverOrdering = solverOptions.linear_solver_ordering;
+
+		configureLinearSolver(blockProblem, params);
+		if (activeSetOpts.bActive)
+			solveActiveSet(params, blockProblem);
+		else
+			CeresSolver::solve(blockProblem);
+
+		solverOptions.linear_solver_type = linearSolverType;
+		solverOptions.linear_solver_ordering = linearSolverOrdering;
+	}
+	else if (resolveEngine(params) == SolverEngine::matrixFree)
+		solveMatrixFree(params);
+	else
+		solveLocally(params);
+}
+
+
+void AppearanceSolver::solveAlternating()
+{
+	int maxIter = solverOptions.max_num_iterations;
+	setMaxNumIteration(scheduleOpts.maxIterPerBlock);
+
+	for (int cycle = 0; cycle < scheduleOpts.numCycles && !bStopRequested; ++cycle)
+	{
+		for (auto& [params, blockProblem] : blockProblems)
+		{
+			if (bStopRequested)
+				break;
+
+			printf("Cycle %d / %d, parameter block 0x%x\n", cycle + 1, scheduleOpts.numCycles, (int)params);
+			solveBlock(params, blockProblem);
+
+			// The other blocks read the normals as constants, so they must see the heights just solved.
+			if (params & ParamSpace::param_normal)
+				constructNormal();
+		}
+	}
+
+	setMaxNumIteration(maxIter);
 }
 
 
 void AppearanceSolver::computeTBNMatrix()
 {
-	if (problemOpts.normalMode == NormalOptMode::raw_normal)
+	TRACE_SCOPE("computeTBNMatrix");
+	if (problemOpts.normalMode == NormalOptMode::raw_normal || tbnMap.empty())
 		return;
 
+	uint64 key = tbnKey();
+	if (loadCachedTBN(key))
+	{
+		printf("TBN matrices are loaded from the cache.\n");
+		return;
+	}
+
 	printf("TBN matrix computation...\n");
 	
 	int nInvalid = 0;
+	auto& tbnMap = this->tbnMap.edit();
 	
 	for (int p : domain)
 	{
@@ -563,7 +961,7 @@ void AppearanceSolver::computeTBNMatrix()
 			Eigen::Vector3d T = positionMap[p + dx] - positionMap[p];
 			Eigen::Vector3d B = N.cross(T).normalized();
 			T = B.cross(N).normalized();
-			tbnMap[p] << T, B, N;
+			tbnMap[p] = { T.cast<float>(), B.cast<float>() };
 		}
 		else
 		{
@@ -582,33 +980,31 @@ void AppearanceSolver::computeTBNMatrix()
 				B = 0.5 * (positionMap[p + dy] - positionMap[p - dy]);
 			}
 
-			if (problemOpts.normalMode == NormalOptMode::heightmap) {
-				tbnMap[p] << T, B, N;
-			}
-			else if (problemOpts.normalMode == NormalOptMode::heightmap2018) {
+			// The normal column, scaled by |T||B| for heightmap2020, is rebuilt by tbnMatrix().
+			if (problemOpts.normalMode == NormalOptMode::heightmap2018) {
 				T = N.cross(T).cross(N).normalized();
 				B = N.cross(B).cross(N).normalized();
-				tbnMap[p] << T, B, N;
-			}
-			else if (problemOpts.normalMode == NormalOptMode::heightmap2020) {
-				tbnMap[p] << T, B, (T.norm() * B.norm()) * N;
 			}
+			tbnMap[p] = { T.cast<float>(), B.cast<float>() };
 		}
 	}
 
 	if (nInvalid > 0)
 		printf("Invaild normals are found : [%d / %d]\n", nInvalid, domain.area());
+
+	saveCachedTBN(key);
 }
 
 
 void AppearanceSolver::constructNormal()
 {
+	TRACE_SCOPE("constructNormal");
 	if (problemOpts.normalMode == NormalOptMode::raw_normal)
 		return;
 
 	for (int p : domain)
 	{
-		Eigen::Matrix3d& tbnMap = this->tbnMap[p];
+		const Eigen::Matrix3d tbnMap = tbnMatrix(p);
 
 		if (problemOpts.normalMode == NormalOptMode::raw_normal2D) {
 			double U = sphereMap[p][0];
@@ -650,9 +1046,10 @@ void AppearanceSolver::constructNormal()
 
 void AppearanceSolver::constructView()
 {
+	TRACE_SCOPE("constructView");
 	for (auto& view : views)
 	{
-		if (isEnabled(view.cameraId))
+		if (isEnabled(view.cameraId) && !view.errorMap.empty())
 		{
 			for (int p : domain)
 			{
@@ -678,7 +1075,7 @@ void AppearanceSolver::writeVisibilityImage()
 		[this](int tot, const auto& view) { return tot + (isEnabled(view.cameraId) ? 1 : 0); });
 	double inc = 1.0 / numViews;
 
-	for (int p = 0; p < height * width; ++p)
+	for (int p : domain)
 	{
 		for (int v = 0; v < views.size(); ++v)
 		{
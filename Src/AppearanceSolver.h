@@ -2,6 +2,10 @@
 #include "pch.h"
 #include "CeresSolver.h"
 #include "SmoothTypes.h"
+#include "SharedMap.h"
+#include "ShadowTable.h"
+#include "CaptureContainer.h"
+#include "ImageWriter.h"
 #define _MIN(x, y) ((x)<(y)?(x):(y))
 #define _MAX(x, y) ((x)<(y)?(y):(x))
 
@@ -15,6 +19,18 @@ enum ParamSpace {
 DEFINE_ENUM_FLAG_OPERATORS(ParamSpace)
 
 
+enum RecordMaps {
+	record_diffuse = 0x1,
+	record_specular = 0x2,
+	record_roughness = 0x4,
+	record_height = 0x8,
+	record_normal = 0x10,
+	record_views = 0x20,
+	record_all = 0x3f,
+};
+DEFINE_ENUM_FLAG_OPERATORS(RecordMaps)
+
+
 enum class NormalOptMode {
 	raw_normal,
 	raw_normal2D,
@@ -31,6 +47,20 @@ enum class DifferenceMode {
 };
 
 
+enum class SolverEngine {
+	automatic,
+	ceres,
+	local,
+	matrixFree
+};
+
+
+enum class SolveSchedule {
+	joint,
+	alternating
+};
+
+
 enum class Param {
 	diffuseR, diffuseG, diffuseB, specular, roughness, height, sphere, MAX, diffuse
 };
@@ -97,6 +127,7 @@ class AppearanceSolver : public CeresSolver
 		std::string inViewMaps			= "viewMap$";
 		std::string inWeightMaps		= "weightMap$";
 		std::string inShadowMaps		= "shadowMap$";
+		std::string inContainer			= "capture.fbc";
 
 		std::string outDir;
 		std::string outFormat			= ".jpg";
@@ -106,7 +137,9 @@ class AppearanceSolver : public CeresSolver
 		std::string outNormalMap		= "normal";
 		std::string outHeightMap		= "height";
 		std::string outRoughnessMap		= "roughness";
+		std::string outSphereMap		= "sphere";
 		std::string loggingfile			= "OupLog.txt";
+		std::string traceFile			= "trace.json";
 	} pathInfo;
 
 	struct ProblemOptions {
@@ -136,6 +169,10 @@ class AppearanceSolver : public CeresSolver
 	struct RecordOptions {
 		bool writeVisibility = false;
 		bool recordIterSeparately = true;
+		int interval = 2;
+		RecordMaps maps = record_all;
+		int numWriters = 2;
+		bool bFloatOutput = false;
 		std::set<int> viewIdices;
 		double maxSpecular = 1.5;
 		double maxRoughness = 0.8;
@@ -143,6 +180,57 @@ class AppearanceSolver : public CeresSolver
 		double maxView = 1.0;
 	} recordOpts;
 
+	struct PyramidOptions {
+		int numLevels = 1;
+		int maxIterPerLevel = 10;
+		int minResolution = 64;
+	} pyramidOpts;
+
+	struct ScheduleOptions {
+		SolveSchedule mode{ SolveSchedule::joint };
+		int numCycles = 3;
+		int maxIterPerBlock = 5;
+	} scheduleOpts;
+
+	struct ConstantOptions {
+		bool bTwoLevel = false;
+		int numCycles = 3;
+		int sampleStride = 8;
+	} constantOpts;
+
+	struct ActiveSetOptions {
+		bool bActive = false;
+		int roundIters = 3;
+		double tolerance = 1e-4;
+	} activeSetOpts;
+
+	struct BudgetOptions {
+		double timeBudget = 0.0;
+		std::shared_ptr<std::atomic<bool>> cancelToken;
+	} budgetOpts;
+
+	struct CheckpointOptions {
+		int interval = 0;
+		std::string fileName = "checkpoint.bin";
+		std::string loadPath;
+		bool bResume = false;
+	} checkpointOpts;
+
+	struct StorageOptions {
+		bool bHalfViews = false;
+		bool bCompressedShadows = false;
+		bool bCropInput = false;
+	} storageOpts;
+
+	struct CacheOptions {
+		bool bActive = true;
+		std::string dir;
+	} cacheOpts;
+
+	SolverEngine engine{ SolverEngine::automatic };
+	bool bGridOrdering = true;
+	bool bHeightFromNormal = false;
+
 	enum SolverState {
 		invalidInputData,
 		invalidSolution,
@@ -166,9 +254,9 @@ public:
 		case Param::roughness:
 			return &roughnessMap[x + y*dy];
 		case Param::height:
-			return &heightMap[x + y*dy];
+			return heightMap.empty() ? nullptr : &heightMap[x + y*dy];
 		case Param::sphere:
-			return &sphereMap[2*(x + y*dy)][0];
+			return sphereMap.empty() ? nullptr : &sphereMap[2*(x + y*dy)][0];
 		}
 	}
 
@@ -180,6 +268,20 @@ public:
 		recordOpts.viewIdices = std::move(viewIdices);
 	}
 
+	// The maps are recorded at every 'interval'th iteration, 0 meaning only when a run is stopped early.
+	// They are copied on the solver thread, and encoded and written by numWriters background threads.
+	void setRecording(int interval, RecordMaps maps = record_all, int numWriters = 2) {
+		recordOpts.interval = _MAX(interval, 0);
+		recordOpts.maps = maps;
+		recordOpts.numWriters = _MAX(numWriters, 1);
+	}
+
+	// Every recorded map is written as a PFM file next to its JPEG, and the final maps of a run are written to
+	// outDir under the out*Map names. warmStartFrom() accepts such a directory.
+	void setFloatOutput(bool bActive) {
+		recordOpts.bFloatOutput = bActive;
+	}
+
 	void setOutputDirectory(std::string outputDir) {
 		pathInfo.outDir = (outputDir.back() == '/' || outputDir.back() == '\\') ?
 			std::move(outputDir) : std::move(outputDir + '/');
@@ -191,8 +293,112 @@ public:
 		changeState(invalidInputData);
 	}
 
+	// Keeps the light samples and cameras of the rig, and reloads only the per-frame maps from frameDir.
+	// The next run() starts from the current solution instead of resetting it.
+	void setFrameDirectory(std::string frameDir) {
+		bool bRigLoaded = solverState > invalidInputData;
+		setInputDirectory(std::move(frameDir));
+		bFrameReload = bRigLoaded;
+	}
+
 	void setDomain(int startX, int startY, int width, int height) {
 		domain.set(startX, startY, width, height);
+		changeState(inputCoversDomain() ? invalidSolution : invalidInputData);
+	}
+
+	// Levels below the full resolution are solved only when the solution is reset,
+	// and each coarse result is upsampled as the initial guess of the next level.
+	void setPyramidLevels(int numLevels, int maxIterPerLevel = 10) {
+		pyramidOpts.numLevels = _MAX(numLevels, 1);
+		pyramidOpts.maxIterPerLevel = maxIterPerLevel;
+		if (!inputCoversDomain())
+			changeState(invalidInputData);
+	}
+
+	// When the height is reset, e.g. after switching from raw_normal to a heightmap mode,
+	// it is integrated from the current normal map by a Poisson solve instead of starting flat.
+	void setHeightFromNormal(bool bActive) {
+		bHeightFromNormal = bActive;
+	}
+
+	// Ceres problems are solved in rounds of roundIters iterations, and a pixel whose parameters and neighbours moved
+	// less than 'tolerance' in a round, while its cost dropped by less than that fraction, is held constant in the next,
+	// so that its residuals drop out of the evaluation.
+	void setActiveSet(bool bActive, int roundIters = 3, double tolerance = 1e-4) {
+		activeSetOpts.bActive = bActive;
+		activeSetOpts.roundIters = _MAX(roundIters, 1);
+		activeSetOpts.tolerance = tolerance;
+	}
+
+	// run() stops at the first iteration boundary after timeBudget seconds of wall-clock time, 0 meaning no budget,
+	// or after the token is set from another thread. The maps of that iteration are recorded before returning.
+	void setTimeBudget(double seconds) {
+		budgetOpts.timeBudget = seconds;
+	}
+
+	void setCancellationToken(std::shared_ptr<std::atomic<bool>> token) {
+		budgetOpts.cancelToken = std::move(token);
+	}
+
+	bool isStopped() const {
+		return bStopRequested;
+	}
+
+	// Keeps the captured views and their weights in half precision, half the size of the float planes of the capture.
+	// The texels are converted to double when they are read, as they are at full precision.
+	void setHalfPrecisionViews(bool bActive) {
+		if (storageOpts.bHalfViews == bActive)
+			return;
+		storageOpts.bHalfViews = bActive;
+		changeState(invalidInputData);
+	}
+
+	// Data derived from the inputs, i.e. the rig tables, the TBN frames and the valid views of every texel, is kept
+	// in cacheDir keyed by a hash of the inputs and options it depends on, and reused by later runs over the same capture.
+	// An empty cacheDir is inDir + "Cache/".
+	void setCacheDirectory(std::string cacheDir, bool bActive = true) {
+		if (!cacheDir.empty() && cacheDir.back() != '/' && cacheDir.back() != '\\')
+			cacheDir += '/';
+		cacheOpts.dir = std::move(cacheDir);
+		cacheOpts.bActive = bActive;
+	}
+
+	// Keeps the shadow visibility delta coded against the first texel of every ShadowTable::kGroupSize texels,
+	// which is decoded for every evaluated texel.
+	void setCompressedShadows(bool bActive) {
+		if (storageOpts.bCompressedShadows == bActive)
+			return;
+		storageOpts.bCompressedShadows = bActive;
+		changeState(invalidInputData);
+	}
+
+	// Loads only the rows of the input maps which the domain and its zeroRadius windows reach, and decodes only the
+	// tiles around the domain from a container. A later domain beyond those rows reloads the inputs.
+	void setCroppedInput(bool bActive) {
+		if (storageOpts.bCropInput == bActive)
+			return;
+		storageOpts.bCropInput = bActive;
+		changeState(invalidInputData);
+	}
+
+	// Every 'interval' iterations the maps, the options and the trust region are written to outDir in the background.
+	void setCheckpointInterval(int interval) {
+		checkpointOpts.interval = interval;
+	}
+
+	// Continues the run saved in the checkpoint, with its options, at the next run(). The run still ends at the
+	// iteration limit it was started with, so run(maxIter) does at most the iterations that were left.
+	void resumeFrom(std::string path) {
+		checkpointOpts.loadPath = std::move(path);
+		checkpointOpts.bResume = true;
+		changeState(invalidSolution);
+	}
+
+	// Starts the next run() from the maps of a previous run instead of random albedo, keeping the current options.
+	// The path is a checkpoint file, or an output directory of a run with float output.
+	void warmStartFrom(std::string path) {
+		checkpointOpts.loadPath = std::move(path);
+		checkpointOpts.bResume = false;
 		changeState(invalidSolution);
 	}
 
@@ -239,9 +445,37 @@ public:
 		if (problemOpts.zeroRadius == radius)
 			return;
 		problemOpts.zeroRadius = radius;
+		changeState(inputCoversDomain() ? invalidProblem : invalidInputData);
+	}
+
+	// In the alternating schedule, diffuse, specular/roughness and normal are solved in turn with the others fixed,
+	// and run() performs numCycles such cycles instead of one joint solve.
+	void setSolveSchedule(SolveSchedule mode, int numCycles = 3, int maxIterPerBlock = 5) {
+		scheduleOpts.numCycles = numCycles;
+		scheduleOpts.maxIterPerBlock = maxIterPerBlock;
+		if (scheduleOpts.mode == mode)
+			return;
+		scheduleOpts.mode = mode;
 		changeState(invalidProblem);
 	}
 
+	// The local engine solves each pixel on its own with a dense Levenberg-Marquardt, which is only possible
+	// when the parameters have no smoothness terms coupling neighbours. 'automatic' picks it whenever possible.
+	// The matrix-free engine never assembles the Jacobian, and recomputes its products in every CG iteration.
+	void setSolverEngine(SolverEngine newEngine) {
+		if (engine == newEngine)
+			return;
+		engine = newEngine;
+		changeState(invalidProblem);
+	}
+
+	// When height is optimized, the appearance blocks are eliminated first and the height field is ordered
+	// by nested dissection of the domain, for that solve only. Other solves, and every solve when it is off,
+	// use the linear solver set through getSolverOptions().
+	void setGridOrdering(bool bActive) {
+		bGridOrdering = bActive;
+	}
+
 	// From here, set** methods can be used to obtain single multi-phase solution.
 	void setParamSpace(ParamSpace params) {
 		if (problemOpts.params == params)
@@ -264,6 +498,17 @@ public:
 		changeState(invalidProblem);
 	}
 
+	// Constant specular/roughness are estimated from one pixel in each sampleStride^2 cell with the maps fixed,
+	// and the per-pixel maps are then solved with the constants fixed, for numCycles cycles.
+	void setTwoLevelConstants(bool bActive, int numCycles = 3, int sampleStride = 8) {
+		constantOpts.numCycles = _MAX(numCycles, 1);
+		constantOpts.sampleStride = _MAX(sampleStride, 1);
+		if (constantOpts.bTwoLevel == bActive)
+			return;
+		constantOpts.bTwoLevel = bActive;
+		changeState(invalidProblem);
+	}
+
 	void setChannelWeight(Eigen::Vector3d weight) {
 		if (problemOpts.channelWeight[0] == weight[0] &&
 			problemOpts.channelWeight[1] == weight[1] &&
@@ -354,6 +599,7 @@ public:
 
 	ceres::CallbackReturnType operator()(const ceres::IterationSummary& summary) override;
 	AppearanceSolver(int width, int height);
+	~AppearanceSolver();
 	void invalidateSolution() { 
 		changeState(invalidSolution); 
 	}
@@ -363,18 +609,95 @@ public:
 	}
 	void run();
 
+	struct SweepConfig {
+		std::string name;
+		std::function<void(AppearanceSolver&)> configure;
+		int maxIter = 21;
+	};
+
+	// Runs the configurations concurrently on copies of this solver that share its loaded inputs and TBN frames,
+	// splitting the threads among them. Each writes to outDir/<name>/, and a table of results goes to outDir.
+	void runSweep(const std::vector<SweepConfig>& configs);
+
+	// Solves the frames of a captured sequence in order, each into its own subdirectory of the output directory.
+	// A frame starts from the previous one, and runs only warmIter iterations if the previous one converged.
+	void runSequence(const std::vector<std::string>& frameDirs, int maxIter, int warmIter);
+
+	// Packs the capture of the input directory into a single container, which the next loads read instead of the
+	// separate files when it is found as inContainer there. Weights and shadow maps are always stored losslessly.
+	bool exportCapture(const std::string& fileName,
+		PlaneEncoding viewEncoding = PlaneEncoding::rgbFloat16,
+		PlaneEncoding geometryEncoding = PlaneEncoding::rgbFloat32);
+
+	struct SyntheticCaptureConfig {
+		int numCameras = 12;
+		int numLightSamples = 750;
+		bool bShadows = true;
+	};
+
+	// Writes a capture of a procedural head at the solver's resolution to the input directory, lit by the rect lights
+	// and seen by the cameras of the rig in rigDir, resampled to the given counts. The views are rendered by evaluate()
+	// from known maps, which are written to inDir/GroundTruth/ as a float output of run() would be.
+	bool generateSyntheticCapture(const std::string& rigDir, const SyntheticCaptureConfig& config);
+	bool generateSyntheticCapture(const std::string& rigDir) {
+		return generateSyntheticCapture(rigDir, SyntheticCaptureConfig());
+	}
+
 private:
+	friend class SolverBenchmark;
+
 	// Remember that below functions can be called only in run() !!
+	bool prepareInputs();
+	bool allocateMaps();
+	void allocateViewMaps();
 	bool loadInputData(std::ostream& log = std::cout);
+	bool loadRigData(std::ostream& log = std::cout);
+	bool loadFrameData(std::ostream& log = std::cout);
+	std::unique_ptr<CaptureReader> openContainer(std::ostream& log) const;
 	void resetSolution();
+	bool loadCheckpoint();
+	void writeCheckpoint(double trustRegionRadius);
+	void recordIteration();
+	void writeResults();
+	bool loadResults(const std::string& dir);
+	std::string cachePath(const char* kind, uint64 key) const;
+	bool loadCachedRig(uint64 key);
+	void saveCachedRig(uint64 key) const;
+	uint64 tbnKey() const;
+	bool loadCachedTBN(uint64 key);
+	void saveCachedTBN(uint64 key) const;
+	void prepareViewMasks();
 	void computeTBNMatrix();
+	void integrateHeight();
 	void createProblem();
+	ceres::Problem* createProblem(ParamSpace params);
+	void solveAlternating();
+	ParamSpace constantParams() const;
+	ParamSpace pixelParams() const;
+	ceres::Problem* createConstantProblem();
+	void solveTwoLevel();
+	using ResidualVisitor = std::function<void(ceres::CostFunction*, const std::vector<double*>&)>;
+	bool visitResidualBlocks(int p, ParamSpace params, const ResidualVisitor& visit);
+
+	bool isPixelSeparable(ParamSpace params) const;
+	SolverEngine resolveEngine(ParamSpace params) const;
+	void solveBlock(ParamSpace params, ceres::Problem* blockProblem);
+	void solveActiveSet(ParamSpace params, ceres::Problem* blockProblem);
+	void solveLocally(ParamSpace params);
+	void solveMatrixFree(ParamSpace params);
+	void configureLinearSolver(ceres::Problem* problem, ParamSpace params);
 
 	void constructNormal();
 	void constructView();
 	void writeVisibilityImage();
 	void printConfigurations();
 
+	void shareInputData(const AppearanceSolver& source);
+
+	void solveCoarseLevels();
+	void downsampleInputData(const AppearanceSolver& fine);
+	void upsampleSolution(const AppearanceSolver& coarse);
+
 	template<typename T>
 	Eigen::Vector<T, 3> evaluate(
 		int viewIdx,
@@ -390,8 +713,9 @@ private:
 		const int v = -1;
 		const int p = -1;
 		const double weight;
-		AccuracyCost(AppearanceSolver& solver, int viewIdx, int pixelIdx, double weight)
-			: solver(solver), v(viewIdx), p(pixelIdx), weight(weight) {}
+		const ParamSpace paramSpace;
+		AccuracyCost(AppearanceSolver& solver, int viewIdx, int pixelIdx, double weight, ParamSpace paramSpace)
+			: solver(solver), v(viewIdx), p(pixelIdx), weight(weight), paramSpace(paramSpace) {}
 	public:
 		template<typename... Params> bool operator()(Params* ... params) const;
 	};
@@ -404,6 +728,74 @@ private:
 		return recordOpts.viewIdices.find(cameraId) != recordOpts.viewIdices.end();
 	}
 
+	// The maps of a normal parametrization are allocated only while the normals are optimized in it.
+	bool usesHeightMap() const {
+		return (problemOpts.params & ParamSpace::param_normal) &&
+			problemOpts.normalMode != NormalOptMode::raw_normal && problemOpts.normalMode != NormalOptMode::raw_normal2D;
+	}
+
+	bool usesSphereMap() const {
+		return (problemOpts.params & ParamSpace::param_normal) && problemOpts.normalMode == NormalOptMode::raw_normal2D;
+	}
+
+	bool usesTBNMap() const {
+		return (problemOpts.params & ParamSpace::param_normal) && problemOpts.normalMode != NormalOptMode::raw_normal;
+	}
+
+	Eigen::Matrix3d tbnMatrix(int p) const {
+		const TangentFrame& frame = tbnMap[p];
+		Eigen::Vector3d T = frame.T.cast<double>();
+		Eigen::Vector3d B = frame.B.cast<double>();
+		Eigen::Vector3d N = geoNormalMap[p];
+		if (problemOpts.normalMode == NormalOptMode::heightmap2020)
+			N *= T.norm() * B.norm();
+
+		Eigen::Matrix3d tbn;
+		tbn << T, B, N;
+		return tbn;
+	}
+
+	double computeViewWeights(int p, std::vector<double>& frameWeights) const {
+		double total_weight = 0.0;
+		frameWeights.assign(views.size(), 0.0);
+
+		for (int v = 0; v < views.size(); v++)
+		{
+			if (isEnabled(views[v].cameraId) && isValidView(v, p))
+			{
+				frameWeights[v] = std::pow(views[v].weightMap[p], problemOpts.viewWeightBias);
+				total_weight += frameWeights[v];
+			}
+		}
+		return total_weight;
+	}
+
+	// A view is valid at a texel of the domain when it captured the whole zeroRadius window and weighs enough.
+	bool isValidView(int v, int p) const {
+		if (viewMasks.empty())
+			return isValidPixel(views[v].trgViewMap, p) && views[v].weightMap[p] > problemOpts.viewWeightMin;
+
+		size_t local = (size_t)(p / width - domain.sy) * (domain.ex - domain.sx) + (p % width - domain.sx);
+		return (viewMasks[local * viewMaskWords + v / 64] >> (v % 64)) & 1;
+	}
+
+	// Rows and columns of the inputs which are loaded, [first, end).
+	std::array<int, 4> inputWindow() const {
+		if (!storageOpts.bCropInput)
+			return { 0, height, 0, width };
+
+		// The windows of isValidPixel() and the TBN stencil reach beyond the domain, and twice as far in fine
+		// texels for every coarser pyramid level.
+		int halo = (problemOpts.zeroRadius + 2) << (pyramidOpts.numLevels - 1);
+		return { _MAX(domain.sy - halo, 0), _MIN(domain.ey + halo, height), _MAX(domain.sx - halo, 0), _MIN(domain.ex + halo, width) };
+	}
+
+	bool inputCoversDomain() const {
+		auto window = inputWindow();
+		return window[0] >= loadedWindow[0] && window[1] <= loadedWindow[1] &&
+			window[2] >= loadedWindow[2] && window[3] <= loadedWindow[3];
+	}
+
 	bool isValidPixel(const auto& viewMap, int p) const {
 		int r = problemOpts.zeroRadius;
 
@@ -431,11 +823,17 @@ private:
 		double area{};
 	};
 
+	// The normal column of a TBN matrix is the geometric normal, so only the tangents are kept.
+	struct TangentFrame {
+		Eigen::Vector3f T;
+		Eigen::Vector3f B;
+	};
+
 	struct ViewData {
 		int								cameraId;
 		Eigen::Vector3d					cameraPos{};
-		std::vector<double>				weightMap;
-		std::vector<Eigen::Vector3d>	trgViewMap;
+		PrecisionMap<double, float, Eigen::half>					weightMap;
+		PrecisionMap<Eigen::Vector3d, Eigen::Vector4f, HalfTexel>	trgViewMap;
 		std::vector<Eigen::Vector3d>	viewMap;
 		std::vector<Eigen::Vector3d>	errorMap;
 	};
@@ -459,13 +857,32 @@ private:
 	std::vector<Eigen::Vector2d>	sphereMap;
 
 	std::vector<LightSample>		lightSamples;
-	std::vector<Eigen::Vector3d>	positionMap;
-	std::vector<Eigen::Vector3d>	geoNormalMap;
+	std::vector<std::pair<int, Eigen::Vector3d>> rigCameras;
+	SharedMap<Eigen::Vector3d, Eigen::Vector4f>	positionMap;
+	SharedMap<Eigen::Vector3d, Eigen::Vector4f>	geoNormalMap;
 	std::vector<ViewData>			views;
-	std::vector<std::vector<uint>>	shadowMaps;
-	std::vector<Eigen::Matrix3d>	tbnMap;
+	ShadowTable						shadowTable;
+	std::array<int, 4>				loadedWindow{};
+	SharedMap<TangentFrame>			tbnMap;
+	SharedMap<uint64>				viewMasks;
+	int								viewMaskWords = 0;
+	uint64							viewMaskKey = 0;
+
+	std::vector<std::pair<ParamSpace, ceres::Problem*>> blockProblems;
+	ceres::Problem*					constantProblem = nullptr;
 
 	bool							bUseShadow = false;
 	int								iterCount = -1;
-	clock_t							lastTime;
+	int								runIterations = 0;
+	int								runIterLimit = 0;
+	double							lastCost = 0.0;
+	double							lastTrustRegionRadius = 0.0;
+	bool							bFrameReload = false;
+	std::chrono::steady_clock::time_point runStart;
+	std::chrono::steady_clock::time_point lastTime;
+	bool							bStopRequested = false;
+	std::thread						checkpointWriter;
+	ImageWriter*					imageWriter = nullptr;
+	std::array<std::deque<std::vector<double>>, 2> snapshots;
+	int								numSnapshots = 0;
 };
@@ -0,0 +1,443 @@
+#include "pch.h"
+#include "CaptureContainer.h"
+#include "AppearanceSolver.h"
+
+
+static constexpr char kCaptureMagic[4] = { 'F', 'B', 'C', 'P' };
+static constexpr uint kCaptureVersion = 1;
+
+
+struct CaptureHeader {
+	char magic[4];
+	uint version;
+	uint width;
+	uint height;
+	uint tileSize;
+	uint numPlanes;
+	uint64 directoryOffset;
+};
+
+
+struct CaptureEntry {
+	char name[64];
+	PlaneEncoding encoding;
+	uint reserved;
+	uint64 offset;		// the bytes of a blob, or the table of numTiles + 1 tile offsets
+	uint64 size;
+};
+
+
+namespace {
+
+// Words are stored as the XOR with the previous texel of the tile, so that coherent shadow bits
+// turn into runs of zeros and similar floats into small numbers. A tile is a sequence of
+// (zero run, literal count, literals) groups, all written as varints.
+void putVarint(std::vector<char>& out, uint64 value)
+{
+	while (value >= 0x80)
+	{
+		out.push_back((char)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((char)value);
+}
+
+uint64 getVarint(const uint8*& in, const uint8* end)
+{
+	uint64 value = 0;
+	for (int shift = 0; in < end && shift < 64; shift += 7)
+	{
+		uint8 byte = *in++;
+		value |= (uint64)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return value;
+	}
+	throw std::runtime_error("File data match error");
+}
+
+void encodeWords(const std::vector<uint>& words, std::vector<char>& out)
+{
+	uint prev = 0;
+	std::vector<uint> deltas(words.size());
+	for (size_t i = 0; i < words.size(); ++i)
+	{
+		deltas[i] = words[i] ^ prev;
+		prev = words[i];
+	}
+
+	for (size_t i = 0; i < deltas.size();)
+	{
+		size_t zeros = 0;
+		while (i + zeros < deltas.size() && deltas[i + zeros] == 0)
+			++zeros;
+		size_t literals = 0;
+		while (i + zeros + literals < deltas.size() && deltas[i + zeros + literals] != 0)
+			++literals;
+
+		putVarint(out, zeros);
+		putVarint(out, literals);
+		for (size_t k = 0; k < literals; ++k)
+			putVarint(out, deltas[i + zeros + k]);
+		i += zeros + literals;
+	}
+}
+
+void decodeWords(const uint8* in, const uint8* end, std::vector<uint>& words)
+{
+	uint prev = 0;
+	size_t i = 0;
+	while (i < words.size())
+	{
+		uint64 zeros = getVarint(in, end);
+		uint64 literals = getVarint(in, end);
+		if (zeros + literals == 0 || i + zeros + literals > words.size())
+			throw std::runtime_error("File data match error");
+
+		for (uint64 k = 0; k < zeros; ++k)
+			words[i++] = prev;
+		for (uint64 k = 0; k < literals; ++k)
+			words[i++] = prev ^= (uint)getVarint(in, end);
+	}
+}
+
+}
+
+
+CaptureReader::CaptureReader(const std::string& filename)
+	: file(filename)
+{
+	CaptureHeader header;
+	if (file.size() < sizeof(header))
+		throw std::runtime_error("File data match error");
+	memcpy(&header, file.data(), sizeof(header));
+
+	if (memcmp(header.magic, kCaptureMagic, sizeof(header.magic)) != 0 || header.version != kCaptureVersion ||
+		header.tileSize == 0 || header.directoryOffset + header.numPlanes * sizeof(CaptureEntry) > file.size())
+		throw std::runtime_error("File data match error");
+
+	w = header.width;
+	h = header.height;
+	tile = header.tileSize;
+
+	const uint64 numTiles = (uint64)numTilesX() * numTilesY();
+	const char* base = (const char*)file.data();
+	for (uint i = 0; i < header.numPlanes; ++i)
+	{
+		CaptureEntry entry;
+		memcpy(&entry, base + header.directoryOffset + i * sizeof(CaptureEntry), sizeof(entry));
+		entry.name[sizeof(entry.name) - 1] = '\0';
+
+		uint64 extent = (entry.encoding == PlaneEncoding::blob) ? entry.size : (numTiles + 1) * sizeof(uint64);
+		if (entry.offset + extent > file.size())
+			throw std::runtime_error("File data match error");
+		planes[entry.name] = { entry.encoding, entry.offset, entry.size };
+	}
+}
+
+
+const CaptureReader::Plane& CaptureReader::plane(const std::string& name) const
+{
+	auto it = planes.find(name);
+	if (it == planes.end())
+		throw std::runtime_error("File open error");
+	return it->second;
+}
+
+
+std::string CaptureReader::readBlob(const std::string& name) const
+{
+	const Plane& blob = plane(name);
+	if (blob.encoding != PlaneEncoding::blob)
+		throw std::runtime_error("File data match error");
+	return std::string((const char*)file.data() + blob.offset, blob.size);
+}
+
+
+// Writes texelWords 32-bit words per texel, where the fourth word of an RGB texel is set to zero.
+void CaptureReader::decodeTile(const Plane& plane, int tx, int ty, uint* out, int texelWords, int stride) const
+{
+	const uint8* base = (const uint8*)file.data();
+	uint64 range[2];
+	memcpy(range, base + plane.offset + ((uint64)ty * numTilesX() + tx) * sizeof(uint64), sizeof(range));
+	if (range[0] > range[1] || range[1] > file.size())
+		throw std::runtime_error("File data match error");
+
+	const uint8* in = base + range[0];
+	const uint8* end = base + range[1];
+	const int tileW = std::min(tile, w - tx * tile);
+	const int tileH = std::min(tile, h - ty * tile);
+	const size_t numTexels = (size_t)tileW * tileH;
+
+	auto texel = [&](size_t i) {
+		return out + ((i / tileW) * stride + i % tileW) * texelWords;
+	};
+
+	if (plane.encoding == PlaneEncoding::rgbFloat32 || plane.encoding == PlaneEncoding::rgbFloat16)
+	{
+		const size_t channelSize = (plane.encoding == PlaneEncoding::rgbFloat32) ? sizeof(float) : sizeof(Eigen::half);
+		if ((size_t)(end - in) != numTexels * 3 * channelSize || texelWords != 4)
+			throw std::runtime_error("File data match error");
+
+		for (size_t i = 0; i < numTexels; ++i)
+		{
+			float* rgba = (float*)texel(i);
+			for (int c = 0; c < 3; ++c, in += channelSize)
+			{
+				if (plane.encoding == PlaneEncoding::rgbFloat32)
+					memcpy(&rgba[c], in, sizeof(float));
+				else
+				{
+					Eigen::half value;
+					memcpy(&value, in, sizeof(value));
+					rgba[c] = (float)value;
+				}
+			}
+			rgba[3] = 0.0f;
+		}
+	}
+	else if (plane.encoding == PlaneEncoding::packedWords)
+	{
+		if (texelWords != 1)
+			throw std::runtime_error("File data match error");
+
+		std::vector<uint> words(numTexels);
+		decodeWords(in, end, words);
+		for (size_t i = 0; i < numTexels; ++i)
+			*texel(i) = words[i];
+	}
+	else
+		throw std::runtime_error("File data match error");
+}
+
+
+void CaptureReader::readTile(const std::string& name, int tx, int ty, Eigen::Vector4f* out, int stride) const
+{
+	static_assert(sizeof(Eigen::Vector4f) == 4 * sizeof(uint));
+	decodeTile(plane(name), tx, ty, (uint*)out, 4, stride);
+}
+
+
+void CaptureReader::readTile(const std::string& name, int tx, int ty, float* out, int stride) const
+{
+	decodeTile(plane(name), tx, ty, (uint*)out, 1, stride);
+}
+
+
+void CaptureReader::readTile(const std::string& name, int tx, int ty, uint* out, int stride) const
+{
+	decodeTile(plane(name), tx, ty, out, 1, stride);
+}
+
+
+CaptureWriter::CaptureWriter(const std::string& filename, int width, int height, int tileSize)
+	: w(width), h(height), tile(tileSize)
+{
+	fp = fopen(filename.c_str(), "wb");
+	if (!fp)
+		throw std::runtime_error("File open error");
+
+	// Rewritten by finish() once the directory offset is known.
+	CaptureHeader header{};
+	write(&header, sizeof(header));
+}
+
+
+CaptureWriter::~CaptureWriter()
+{
+	if (fp)
+		fclose(fp);
+}
+
+
+void CaptureWriter::write(const void* data, size_t size)
+{
+	fwrite(data, 1, size, fp);
+	position += size;
+}
+
+
+void CaptureWriter::addTiles(const std::string& name, PlaneEncoding encoding, std::function<void(int, int, std::vector<char>&)> encodeTile)
+{
+	const int numTilesX = (w + tile - 1) / tile;
+	const int numTilesY = (h + tile - 1) / tile;
+
+	std::vector<uint64> offsets;
+	offsets.reserve((size_t)numTilesX * numTilesY + 1);
+	std::vector<char> bytes;
+
+	for (int ty = 0; ty < numTilesY; ++ty)
+		for (int tx = 0; tx < numTilesX; ++tx)
+	{
+		bytes.clear();
+		encodeTile(tx, ty, bytes);
+		offsets.push_back(position);
+		write(bytes.data(), bytes.size());
+	}
+	offsets.push_back(position);
+
+	entries.push_back({ name, encoding, position, offsets.back() - offsets.front() });
+	write(offsets.data(), offsets.size() * sizeof(uint64));
+}
+
+
+void CaptureWriter::addBlob(const std::string& name, const std::string& bytes)
+{
+	entries.push_back({ name, PlaneEncoding::blob, position, bytes.size() });
+	write(bytes.data(), bytes.size());
+}
+
+
+void CaptureWriter::addPlane(const std::string& name, const Eigen::Vector4f* texels, PlaneEncoding encoding)
+{
+	addTiles(name, encoding, [&](int tx, int ty, std::vector<char>& bytes) {
+		for (int i = ty * tile; i < std::min((ty + 1) * tile, h); ++i)
+			for (int j = tx * tile; j < std::min((tx + 1) * tile, w); ++j)
+		{
+			const Eigen::Vector4f& rgba = texels[(size_t)i * w + j];
+			for (int c = 0; c < 3; ++c)
+			{
+				if (encoding == PlaneEncoding::rgbFloat32)
+					bytes.insert(bytes.end(), (const char*)&rgba[c], (const char*)&rgba[c] + sizeof(float));
+				else
+				{
+					Eigen::half value(rgba[c]);
+					bytes.insert(bytes.end(), (const char*)&value, (const char*)&value + sizeof(value));
+				}
+			}
+		}
+	});
+}
+
+
+void CaptureWriter::addPlane(const std::string& name, const float* texels)
+{
+	addPlane(name, (const uint*)texels);
+}
+
+
+void CaptureWriter::addPlane(const std::string& name, const uint* texels)
+{
+	std::vector<uint> words;
+	addTiles(name, PlaneEncoding::packedWords, [&](int tx, int ty, std::vector<char>& bytes) {
+		words.clear();
+		for (int i = ty * tile; i < std::min((ty + 1) * tile, h); ++i)
+			for (int j = tx * tile; j < std::min((tx + 1) * tile, w); ++j)
+				words.push_back(texels[(size_t)i * w + j]);
+		encodeWords(words, bytes);
+	});
+}
+
+
+bool CaptureWriter::finish()
+{
+	CaptureHeader header{};
+	memcpy(header.magic, kCaptureMagic, sizeof(header.magic));
+	header.version = kCaptureVersion;
+	header.width = w;
+	header.height = h;
+	header.tileSize = tile;
+	header.numPlanes = (uint)entries.size();
+	header.directoryOffset = position;
+
+	for (const auto& entry : entries)
+	{
+		CaptureEntry out{};
+		strncpy(out.name, entry.name.c_str(), sizeof(out.name) - 1);
+		out.encoding = entry.encoding;
+		out.offset = entry.offset;
+		out.size = entry.size;
+		write(&out, sizeof(out));
+	}
+
+	fseek(fp, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, fp);
+	bool ok = !ferror(fp);
+	ok &= fclose(fp) == 0;
+	fp = nullptr;
+	return ok;
+}
+
+
+std::unique_ptr<CaptureReader> AppearanceSolver::openContainer(std::ostream& log) const
+{
+	std::string path = pathInfo.inDir + pathInfo.inContainer;
+	if (pathInfo.inContainer.empty() || !std::filesystem::exists(path))
+		return nullptr;
+
+	try
+	{
+		auto container = std::make_unique<CaptureReader>(path);
+		if (container->width() == width && container->height() == height)
+			return container;
+		log << "-> The container does not match the resolution of this solver: " << pathInfo.inContainer << std::endl;
+	}
+	catch (std::runtime_error& e)
+	{
+		log << "-> " << e.what() << ": " << pathInfo.inContainer << std::endl;
+	}
+	return nullptr;
+}
+
+
+bool AppearanceSolver::exportCapture(const std::string& fileName, PlaneEncoding viewEncoding, PlaneEncoding geometryEncoding)
+{
+	printf("Exporting the capture to %s...\n", fileName.c_str());
+
+	// The planes are exported from the precision of the capture, whatever the views are kept in for solving.
+	StorageOptions storage = storageOpts;
+	storageOpts.bHalfViews = false;
+	storageOpts.bCropInput = false;
+	bool loaded = loadRigData() && loadFrameData();
+	storageOpts = storage;
+
+	if (!loaded)
+	{
+		printf("[WARNING] The capture cannot be exported, since its input data cannot be loaded.\n");
+		return false;
+	}
+
+	// The maps are now loaded, but the solution and the TBN matrices were never made for them.
+	changeState(invalidInputData);
+
+	auto container = openContainer(std::cout);
+	auto readText = [&](const std::string& name) {
+		if (container)
+			return container->hasPlane(name) ? container->readBlob(name) : std::string();
+		std::ifstream file(pathInfo.inDir + name, std::ios::binary);
+		return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	};
+
+	try
+	{
+		CaptureWriter writer(fileName, width, height);
+		writer.addBlob(pathInfo.inLightSampleInfo, readText(pathInfo.inLightSampleInfo));
+		writer.addBlob(pathInfo.inCameraInfo, readText(pathInfo.inCameraInfo));
+
+		auto planeName = [](std::string pattern, int index) {
+			pattern.replace(pattern.find_last_of('$'), 1, std::to_string(index));
+			return pattern;
+		};
+
+		for (int i = 0; i < shadowTable.words(); ++i)
+			writer.addPlane(planeName(pathInfo.inShadowMaps, i + 1), shadowTable.plane(i).data());
+		writer.addPlane(pathInfo.inPositionMap, positionMap.data(), geometryEncoding);
+		writer.addPlane(pathInfo.inNormalMap, geoNormalMap.data(), geometryEncoding);
+
+		for (auto& view : views)
+		{
+			writer.addPlane(planeName(pathInfo.inViewMaps, view.cameraId), view.trgViewMap.stored().data(), viewEncoding);
+			writer.addPlane(planeName(pathInfo.inWeightMaps, view.cameraId), view.weightMap.stored().data());
+		}
+
+		if (!writer.finish())
+			throw std::runtime_error("File write error");
+	}
+	catch (std::runtime_error& e)
+	{
+		printf("[WARNING] %s: %s\n", e.what(), fileName.c_str());
+		return false;
+	}
+
+	printf("%d shadow maps, the geometry and %d views are exported.\n", shadowTable.words(), (int)views.size());
+	return true;
+}
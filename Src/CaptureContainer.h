@@ -0,0 +1,116 @@
+#pragma once
+#include "pch.h"
+#include "utils.h"
+
+
+enum class PlaneEncoding : uint {
+	rgbFloat32,		// three floats per texel
+	rgbFloat16,		// three half floats per texel
+	packedWords,	// one 32-bit word per texel, compressed without loss
+	blob,			// the bytes of an embedded file
+};
+
+
+// Reads a capture stored as a single file. Every plane is split into square tiles which are decoded independently.
+class CaptureReader
+{
+	struct Plane {
+		PlaneEncoding encoding;
+		uint64 offset;
+		uint64 size;
+	};
+
+	MappedFile file;
+	std::map<std::string, Plane> planes;
+	int w = 0;
+	int h = 0;
+	int tile = 0;
+
+	const Plane& plane(const std::string& name) const;
+	void decodeTile(const Plane& plane, int tx, int ty, uint* out, int texelWords, int stride) const;
+
+public:
+	CaptureReader(const std::string& filename);
+
+	int width() const			{ return w; }
+	int height() const			{ return h; }
+	int tileSize() const		{ return tile; }
+	int numTilesX() const		{ return (w + tile - 1) / tile; }
+	int numTilesY() const		{ return (h + tile - 1) / tile; }
+
+	bool hasPlane(const std::string& name) const { return planes.count(name) > 0; }
+	std::string readBlob(const std::string& name) const;
+
+	// The texels of a tile are written at out, whose rows are stride texels apart.
+	void readTile(const std::string& name, int tx, int ty, Eigen::Vector4f* out, int stride) const;
+	void readTile(const std::string& name, int tx, int ty, float* out, int stride) const;
+	void readTile(const std::string& name, int tx, int ty, uint* out, int stride) const;
+
+	// Only the tiles overlapping the rows [firstRow, endRow) and the columns [firstCol, endCol) are decoded.
+	// The map holds those rows, and the texels of the skipped tiles are zero.
+	template<typename T, typename Stored>
+	void readPlane(const std::string& name, SharedMap<T, Stored>& out,
+		int firstRow = 0, int endRow = INT_MAX, int firstCol = 0, int endCol = INT_MAX) const
+	{
+		endRow = std::min(endRow, h);
+		endCol = std::min(endCol, w);
+
+		// Eigen vectors are left uninitialized by their default constructor, so zero is spelled out.
+		Stored zero;
+		if constexpr (std::is_arithmetic_v<Stored>)
+			zero = 0;
+		else
+			zero.setZero();
+
+		auto& texels = out.edit();
+		texels.assign((size_t)(endRow - firstRow) * w, zero);
+		out.setFirst((size_t)firstRow * w);
+
+		std::vector<Stored> band((size_t)tile * w);
+		for (int ty = firstRow / tile; ty * tile < endRow; ++ty)
+		{
+			std::fill(band.begin(), band.end(), zero);
+			for (int tx = firstCol / tile; tx * tile < endCol; ++tx)
+				readTile(name, tx, ty, band.data() + (size_t)tx * tile, w);
+
+			int y0 = std::max(ty * tile, firstRow);
+			int y1 = std::min((ty + 1) * tile, endRow);
+			std::copy_n(band.begin() + (size_t)(y0 - ty * tile) * w, (size_t)(y1 - y0) * w,
+				texels.begin() + (size_t)(y0 - firstRow) * w);
+		}
+	}
+};
+
+
+// Writes the planes of a capture one after another, and the directory of the planes when finished.
+class CaptureWriter
+{
+	struct Entry {
+		std::string name;
+		PlaneEncoding encoding;
+		uint64 offset;
+		uint64 size;
+	};
+
+	FILE* fp = nullptr;
+	uint64 position = 0;
+	std::vector<Entry> entries;
+	int w = 0;
+	int h = 0;
+	int tile = 0;
+
+	void write(const void* data, size_t size);
+	void addTiles(const std::string& name, PlaneEncoding encoding, std::function<void(int, int, std::vector<char>&)> encodeTile);
+
+public:
+	CaptureWriter(const std::string& filename, int width, int height, int tileSize = 64);
+	~CaptureWriter();
+	CaptureWriter(const CaptureWriter&) = delete;
+	CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+	void addBlob(const std::string& name, const std::string& bytes);
+	void addPlane(const std::string& name, const Eigen::Vector4f* texels, PlaneEncoding encoding);
+	void addPlane(const std::string& name, const float* texels);
+	void addPlane(const std::string& name, const uint* texels);
+	bool finish();
+};
@@ -2,6 +2,41 @@
 #include "pch.h"
 
 
+#ifdef TRACE
+// Splits each Ceres iteration, from the end of the previous iteration callback, into the linear solve until the
+// first evaluation, the evaluation of the residuals at the candidate point, and of the Jacobians once it is accepted.
+class TracePhases : public ceres::EvaluationCallback
+{
+	const char* phase = nullptr;
+	double phaseBegin = 0.0;
+	double iterationBegin = 0.0;
+
+	void next(const char* nextPhase) {
+		double t = trace::now();
+		trace::record(phase, phaseBegin, t);
+		phase = nextPhase;
+		phaseBegin = t;
+	}
+
+public:
+	void begin(const char* firstPhase) {
+		phase = firstPhase;
+		phaseBegin = iterationBegin = trace::now();
+	}
+
+	void end() {
+		double t = trace::now();
+		trace::record(phase, phaseBegin, t);
+		trace::record("ceres iteration", iterationBegin, t);
+	}
+
+	void PrepareForEvaluation(bool bJacobians, bool bNewPoint) override {
+		next(bJacobians ? "jacobian evaluation" : "residual evaluation");
+	}
+};
+#endif
+
+
 class CeresSolver : public ceres::IterationCallback
 {
 public:
@@ -52,17 +87,57 @@ public:
 
 protected:
 	void solve()
+	{
+		solve(problem);
+	}
+
+	void solve(ceres::Problem* problem)
 	{
 		ceres::Solver::Summary summary;
 
 		std::cout << "Solving the problem.\n";
-		Solve(solverOptions, problem, &summary);
+		{
+			TRACE_SCOPE("ceres solve");
+#ifdef TRACE
+			tracePhases.begin("preprocessing");
+#endif
+			Solve(solverOptions, problem, &summary);
+		}
 
 		std::string result = summary.FullReport();
 		std::cout << result << "\n";
 	}
 
+	// Problems are created here, so that their evaluations can be traced.
+	ceres::Problem* newProblem()
+	{
+		ceres::Problem::Options options;
+#ifdef TRACE
+		options.evaluation_callback = &tracePhases;
+#endif
+		return new ceres::Problem(options);
+	}
+
+	// Called at the start and the end of every iteration callback.
+	void traceIterationEnd()
+	{
+#ifdef TRACE
+		tracePhases.end();
+#endif
+	}
+
+	void traceIterationBegin()
+	{
+#ifdef TRACE
+		tracePhases.begin("linear solve");
+#endif
+	}
+
 	SolverOptions solverOptions;
 	const int maxParams = 20;
 	ceres::Problem* problem = nullptr;
+
+#ifdef TRACE
+	TracePhases tracePhases;
+#endif
 };
\ No newline at end of file
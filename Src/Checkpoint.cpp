@@ -0,0 +1,279 @@
+#include "pch.h"
+#include "AppearanceSolver.h"
+#include <filesystem>
+
+
+static constexpr char kCheckpointMagic[4] = { 'F', 'B', 'C', 'K' };
+static constexpr int kCheckpointVersion = 3;
+
+
+struct CheckpointHeader {
+	char magic[4];
+	int version;
+	int width;
+	int height;
+	int iterCount;
+	int iterLimit;
+	int domain[4];
+	double trustRegionRadius;
+};
+
+
+namespace {
+
+class CheckpointWriter {
+	std::vector<char>& buffer;
+public:
+	CheckpointWriter(std::vector<char>& buffer) : buffer(buffer) {}
+
+	void put(const void* data, size_t size) {
+		buffer.insert(buffer.end(), (const char*)data, (const char*)data + size);
+	}
+
+	template<typename T>
+	void put(const T& value) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		put(&value, sizeof(T));
+	}
+
+	template<typename A, typename B>
+	void put(const std::pair<A, B>& value) {
+		put(value.first);
+		put(value.second);
+	}
+
+	// Maps which the run never allocated are written as empty arrays.
+	template<typename T>
+	void putArray(const std::vector<T>& values) {
+		put((uint64)values.size());
+		put(values.data(), values.size() * sizeof(T));
+	}
+};
+
+class CheckpointReader {
+	FILE* fp;
+public:
+	CheckpointReader(FILE* fp) : fp(fp) {}
+
+	bool get(void* data, size_t size) {
+		return fread(data, 1, size, fp) == size;
+	}
+
+	template<typename T>
+	bool get(T& value) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		return get(&value, sizeof(T));
+	}
+
+	template<typename A, typename B>
+	bool get(std::pair<A, B>& value) {
+		return get(value.first) && get(value.second);
+	}
+
+	template<typename T>
+	bool getArray(std::vector<T>& values, size_t fullSize) {
+		uint64 size = 0;
+		if (!get(size) || (size != 0 && size != fullSize))
+			return false;
+		values.resize(size);
+		return get(values.data(), values.size() * sizeof(T));
+	}
+};
+
+}
+
+
+void AppearanceSolver::writeCheckpoint(double trustRegionRadius)
+{
+	const auto& opt = problemOpts;
+
+	// The maps are only copied here, and the file is written by a background thread while the solver goes on.
+	std::vector<char> buffer;
+	buffer.reserve(width * height * sizeof(double) * 13 + 4096);
+	CheckpointWriter out(buffer);
+
+	CheckpointHeader header{};
+	memcpy(header.magic, kCheckpointMagic, sizeof(header.magic));
+	header.version = kCheckpointVersion;
+	header.width = width;
+	header.height = height;
+	header.iterCount = iterCount;
+	header.iterLimit = runIterLimit;
+	header.domain[0] = domain.sx;
+	header.domain[1] = domain.sy;
+	header.domain[2] = domain.ex;
+	header.domain[3] = domain.ey;
+	header.trustRegionRadius = trustRegionRadius;
+	out.put(header);
+
+	out.put(opt.normalMode);
+	out.put(opt.diffMode);
+	out.put(opt.bActiveShadow);
+	out.put(opt.viewWeightMin);
+	out.put(opt.viewWeightBias);
+	out.put(opt.zeroRadius);
+	out.put(opt.params);
+	out.put(opt.constantSpecular);
+	out.put(opt.constantRoughness);
+	out.put(opt.channelWeight);
+	out.put(opt.base);
+
+	out.put((int)opt.smoothWeightAndExp.size());
+	for (auto& [param_type, weight_exp] : opt.smoothWeightAndExp)
+	{
+		out.put(param_type);
+		out.put(weight_exp);
+	}
+
+	out.put((int)opt.bounds.size());
+	for (auto& [param, bound] : opt.bounds)
+	{
+		out.put(param);
+		out.put(bound);
+	}
+
+	out.putArray(diffuseMap);
+	out.putArray(specularMap);
+	out.putArray(roughnessMap);
+	out.putArray(heightMap);
+	out.putArray(normalMap);
+	out.putArray(sphereMap);
+
+	if (checkpointWriter.joinable())
+		checkpointWriter.join();
+
+	// Written next to the previous checkpoint and renamed, so a crash while writing never loses the last one.
+	std::string path = pathInfo.outDir + checkpointOpts.fileName;
+	checkpointWriter = std::thread([buffer = std::move(buffer), path]() {
+		std::string tempPath = path + ".tmp";
+		FILE* fp = fopen(tempPath.c_str(), "wb");
+		if (!fp)
+		{
+			printf("[WARNING] Cannot open the checkpoint file: %s\n", tempPath.c_str());
+			return;
+		}
+		bool written = fwrite(buffer.data(), 1, buffer.size(), fp) == buffer.size();
+		fclose(fp);
+
+		std::error_code error;
+		if (written)
+			std::filesystem::rename(tempPath, path, error);
+		if (!written || error)
+			printf("[WARNING] Failed to write the checkpoint file: %s\n", path.c_str());
+	});
+}
+
+
+bool AppearanceSolver::loadCheckpoint()
+{
+	const std::string& path = checkpointOpts.loadPath;
+	if (std::filesystem::is_directory(path))
+	{
+		// Result maps carry no solver state, so they can only warm start.
+		checkpointOpts.bResume = false;
+		return loadResults(path);
+	}
+
+	printf("Loading the checkpoint: %s\n", path.c_str());
+
+	FILE* fp = fopen(path.c_str(), "rb");
+	if (!fp)
+	{
+		printf("[WARNING] Cannot open the checkpoint, and the solution is reset instead.\n");
+		return false;
+	}
+	CheckpointReader in(fp);
+
+	CheckpointHeader header;
+	if (!in.get(header) || memcmp(header.magic, kCheckpointMagic, sizeof(header.magic)) != 0 ||
+		header.version != kCheckpointVersion || header.width != width || header.height != height)
+	{
+		printf("[WARNING] The checkpoint does not match this solver, and the solution is reset instead.\n");
+		fclose(fp);
+		return false;
+	}
+
+	// Options are always parsed to reach the maps, but only a resume applies them.
+	ProblemOptions opt = problemOpts;
+	bool ok = true;
+	ok &= in.get(opt.normalMode);
+	ok &= in.get(opt.diffMode);
+	ok &= in.get(opt.bActiveShadow);
+	ok &= in.get(opt.viewWeightMin);
+	ok &= in.get(opt.viewWeightBias);
+	ok &= in.get(opt.zeroRadius);
+	ok &= in.get(opt.params);
+	ok &= in.get(opt.constantSpecular);
+	ok &= in.get(opt.constantRoughness);
+	ok &= in.get(opt.channelWeight);
+	ok &= in.get(opt.base);
+
+	int numSmooth = 0;
+	ok &= in.get(numSmooth);
+	opt.smoothWeightAndExp.clear();
+	for (int i = 0; ok && i < numSmooth; ++i)
+	{
+		std::pair<Param, SmoothType> param_type;
+		std::pair<double, double> weight_exp;
+		ok &= in.get(param_type) && in.get(weight_exp);
+		opt.smoothWeightAndExp[param_type] = weight_exp;
+	}
+
+	int numBounds = 0;
+	ok &= in.get(numBounds);
+	opt.bounds.clear();
+	for (int i = 0; ok && i < numBounds; ++i)
+	{
+		Param param;
+		std::pair<double, double> bound;
+		ok &= in.get(param) && in.get(bound);
+		opt.bounds[param] = bound;
+	}
+
+	decltype(diffuseMap) diffuse;
+	decltype(specularMap) specular;
+	decltype(roughnessMap) roughness;
+	decltype(heightMap) heights;
+	decltype(normalMap) normals;
+	decltype(sphereMap) spheres;
+	const size_t area = (size_t)width * height;
+	ok = ok && in.getArray(diffuse, area) && in.getArray(specular, area) && in.getArray(roughness, area) &&
+		in.getArray(heights, area) && in.getArray(normals, area) && in.getArray(spheres, area);
+	fclose(fp);
+
+	if (!ok)
+	{
+		printf("[WARNING] The checkpoint is truncated, and the solution is reset instead.\n");
+		return false;
+	}
+
+	diffuseMap.swap(diffuse);
+	specularMap.swap(specular);
+	roughnessMap.swap(roughness);
+	heightMap.swap(heights);
+	normalMap.swap(normals);
+	sphereMap.swap(spheres);
+
+	if (checkpointOpts.bResume)
+	{
+		problemOpts = std::move(opt);
+		domain.sx = header.domain[0];
+		domain.sy = header.domain[1];
+		domain.ex = header.domain[2];
+		domain.ey = header.domain[3];
+
+		// The first callback of the continued solve reports the saved iteration again,
+		// and the solve stops at the iteration limit of the saved run.
+		iterCount = header.iterCount - 1;
+		if (header.trustRegionRadius > 0.0)
+			solverOptions.initial_trust_region_radius = header.trustRegionRadius;
+		setMaxNumIteration(_MAX(_MIN(solverOptions.max_num_iterations, header.iterLimit - header.iterCount), 0));
+		printf("Resuming from iteration %d of %d.\n", header.iterCount, header.iterLimit);
+	}
+	else
+	{
+		iterCount = -1;
+	}
+
+	return true;
+}
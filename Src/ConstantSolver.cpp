@@ -0,0 +1,109 @@
+#include "pch.h"
+#include "AppearanceSolver.h"
+#include <random>
+
+
+ParamSpace AppearanceSolver::constantParams() const
+{
+	ParamSpace params{};
+	if ((problemOpts.params & ParamSpace::param_specular) && problemOpts.constantSpecular)
+		params |= ParamSpace::param_specular;
+	if ((problemOpts.params & ParamSpace::param_roughness) && problemOpts.constantRoughness)
+		params |= ParamSpace::param_roughness;
+	return params;
+}
+
+
+ParamSpace AppearanceSolver::pixelParams() const
+{
+	if (constantOpts.bTwoLevel)
+		return problemOpts.params & ~constantParams();
+	return problemOpts.params;
+}
+
+
+ceres::Problem* AppearanceSolver::createConstantProblem()
+{
+	const auto& opt = problemOpts;
+	const ParamSpace params = constantParams();
+	const int stride = constantOpts.sampleStride;
+
+	ceres::Problem* problem = newProblem();
+	auto addResidual = [problem](ceres::CostFunction* cost, const std::vector<double*>& blockParams) {
+		problem->AddResidualBlock(cost, nullptr, blockParams);
+	};
+
+	// One pixel at a random position in each cell, so the sample covers the whole domain without aliasing its grid.
+	std::mt19937 rng;
+	int numSamples = 0;
+
+	for (int cy = domain.sy; cy < domain.ey; cy += stride)
+		for (int cx = domain.sx; cx < domain.ex; cx += stride)
+	{
+		int x = cx + (int)(rng() % _MIN(stride, domain.ex - cx));
+		int y = cy + (int)(rng() % _MIN(stride, domain.ey - cy));
+		if (visitResidualBlocks(y * width + x, params, addResidual))
+			++numSamples;
+	}
+
+	if (numSamples > 0)
+	{
+		auto setBound = [&](Param param, double* x) {
+			if (auto it = opt.bounds.find(param); it != opt.bounds.end())
+			{
+				if (it->second.first != DBL_MAX)  problem->SetParameterLowerBound(x, 0, it->second.first);
+				if (it->second.second != DBL_MIN) problem->SetParameterUpperBound(x, 0, it->second.second);
+			}
+		};
+		if (params & ParamSpace::param_specular)
+			setBound(Param::specular, &specularMap[0]);
+		if (params & ParamSpace::param_roughness)
+			setBound(Param::roughness, &roughnessMap[0]);
+	}
+
+	printf("Constant parameters are estimated from %d sampled pixels.\n", numSamples);
+	return problem;
+}
+
+
+void AppearanceSolver::solveTwoLevel()
+{
+	const int maxIter = solverOptions.max_num_iterations;
+	const ParamSpace params = pixelParams();
+
+	for (int cycle = 0; cycle < constantOpts.numCycles && !bStopRequested; ++cycle)
+	{
+		printf("Cycle %d / %d, constant parameters\n", cycle + 1, constantOpts.numCycles);
+
+		// At most two unknowns, so a dense solve without the iteration callback which records the maps.
+		if (constantProblem->NumResidualBlocks() > 0)
+		{
+			SolverOptions pixelOptions = solverOptions;
+			solverOptions.linear_solver_type = ceres::DENSE_QR;
+			solverOptions.linear_solver_ordering = nullptr;
+			solverOptions.callbacks.clear();
+			CeresSolver::solve(constantProblem);
+			solverOptions = pixelOptions;
+		}
+
+		FILE* fp = fopen((pathInfo.outDir + pathInfo.loggingfile).c_str(), "a");
+		fprintf(fp, "Cycle %d :\n", cycle + 1);
+		if (problemOpts.constantSpecular)  fprintf(fp, "\tConstantSpecular    :  %lf\n", specularMap[0]);
+		if (problemOpts.constantRoughness) fprintf(fp, "\tConstantRoughness   :  %lf\n", roughnessMap[0]);
+		fclose(fp);
+
+		if (!params)
+			continue;
+
+		// The iteration budget of run() is shared by the per-pixel solves of all cycles.
+		printf("Cycle %d / %d, per-pixel parameters\n", cycle + 1, constantOpts.numCycles);
+		setMaxNumIteration(_MAX(maxIter / constantOpts.numCycles, 1));
+
+		if (scheduleOpts.mode == SolveSchedule::alternating)
+			solveAlternating();
+		else
+			solveBlock(params, problem);
+
+		setMaxNumIteration(maxIter);
+	}
+}
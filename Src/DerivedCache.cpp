@@ -0,0 +1,298 @@
+#include "pch.h"
+#include "AppearanceSolver.h"
+#include "utils.h"
+#include <filesystem>
+
+
+static constexpr char kCacheMagic[4] = { 'F', 'B', 'D', 'C' };
+static constexpr int kCacheVersion = 1;
+
+
+// The entries follow a 64-byte header, so that mapped entries are aligned as allocated ones are.
+struct CacheHeader {
+	char magic[4];
+	int version;
+	uint64 key;
+	uint64 count;
+	uint64 elementSize;
+	char reserved[32];
+};
+static_assert(sizeof(CacheHeader) == 64);
+
+
+namespace {
+
+class KeyHasher {
+	uint64 h = 0;
+public:
+	KeyHasher& add(const void* data, size_t bytes) {
+		h = hashBytes(data, bytes, h);
+		return *this;
+	}
+
+	template<typename T>
+	KeyHasher& add(const T& value) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		return add(&value, sizeof(T));
+	}
+
+	KeyHasher& add(const std::string& text) {
+		return add(text.data(), text.size());
+	}
+
+	uint64 value() const { return h; }
+};
+
+// Stored instead of the pairs of rigCameras, whose padding is not initialized.
+struct CachedCamera {
+	int id;
+	int pad;
+	double position[3];
+};
+
+}
+
+
+// Returns nullptr when the entry is missing, or was written for another key or layout.
+static std::shared_ptr<MappedFile> openEntry(const std::string& path, uint64 key, size_t elementSize, size_t& count)
+{
+	if (path.empty() || !std::filesystem::exists(path))
+		return nullptr;
+
+	try
+	{
+		auto file = std::make_shared<MappedFile>(path);
+		if (file->size() < sizeof(CacheHeader))
+			return nullptr;
+
+		CacheHeader header;
+		memcpy(&header, file->data(), sizeof(header));
+		if (memcmp(header.magic, kCacheMagic, 4) != 0 || header.version != kCacheVersion ||
+			header.key != key || header.elementSize != elementSize ||
+			file->size() != sizeof(CacheHeader) + header.count * elementSize)
+			return nullptr;
+
+		count = (size_t)header.count;
+		return file;
+	}
+	catch (std::runtime_error&)
+	{
+		return nullptr;
+	}
+}
+
+
+static const void* entryData(const MappedFile& file)
+{
+	return (const char*)file.data() + sizeof(CacheHeader);
+}
+
+
+// Entries are written under a temporary name and renamed, so that concurrent runs never map a partial entry.
+static void writeEntry(const std::string& path, uint64 key, const void* data, size_t elementSize, size_t count)
+{
+	if (path.empty())
+		return;
+
+	std::error_code error;
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+
+	std::string tempPath = path + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+	FILE* fp = fopen(tempPath.c_str(), "wb");
+	if (!fp)
+	{
+		printf("[WARNING] Failed to write the cache entry: %s\n", path.c_str());
+		return;
+	}
+
+	CacheHeader header{};
+	memcpy(header.magic, kCacheMagic, 4);
+	header.version = kCacheVersion;
+	header.key = key;
+	header.count = count;
+	header.elementSize = elementSize;
+
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	if (count > 0)
+		ok &= fwrite(data, elementSize, count, fp) == count;
+	ok &= fclose(fp) == 0;
+
+	if (ok)
+		std::filesystem::rename(tempPath, path, error);
+	if (!ok || error)
+	{
+		std::filesystem::remove(tempPath, error);
+		printf("[WARNING] Failed to write the cache entry: %s\n", path.c_str());
+	}
+}
+
+
+std::string AppearanceSolver::cachePath(const char* kind, uint64 key) const
+{
+	if (!cacheOpts.bActive || (cacheOpts.dir.empty() && pathInfo.inDir.empty()))
+		return "";
+
+	char name[32];
+	snprintf(name, sizeof(name), "_%016llx.bin", key);
+	return (cacheOpts.dir.empty() ? pathInfo.inDir + "Cache/" : cacheOpts.dir) + kind + name;
+}
+
+
+bool AppearanceSolver::loadCachedRig(uint64 key)
+{
+	size_t numLights = 0;
+	size_t numCameras = 0;
+	auto lightFile = openEntry(cachePath("lights", key), key, sizeof(LightSample), numLights);
+	auto cameraFile = openEntry(cachePath("cameras", key), key, sizeof(CachedCamera), numCameras);
+	if (!lightFile || !cameraFile)
+		return false;
+
+	const LightSample* lights = (const LightSample*)entryData(*lightFile);
+	lightSamples.assign(lights, lights + numLights);
+
+	const CachedCamera* cameras = (const CachedCamera*)entryData(*cameraFile);
+	for (size_t c = 0; c < numCameras; ++c)
+		rigCameras.emplace_back(cameras[c].id, Eigen::Vector3d(cameras[c].position));
+	return true;
+}
+
+
+void AppearanceSolver::saveCachedRig(uint64 key) const
+{
+	std::vector<CachedCamera> cameras;
+	for (const auto& [id, position] : rigCameras)
+		cameras.push_back({ id, 0, { position[0], position[1], position[2] } });
+
+	writeEntry(cachePath("lights", key), key, lightSamples.data(), sizeof(LightSample), lightSamples.size());
+	writeEntry(cachePath("cameras", key), key, cameras.data(), sizeof(CachedCamera), cameras.size());
+}
+
+
+// The frames of the domain read the geometry one texel around it.
+uint64 AppearanceSolver::tbnKey() const
+{
+	KeyHasher hasher;
+	hasher.add(width).add(height).add(domain.sx).add(domain.sy).add(domain.ex).add(domain.ey)
+		.add(problemOpts.normalMode).add(problemOpts.diffMode);
+
+	size_t first = (size_t)_MAX(domain.sy - 1, 0) * width;
+	size_t last = (size_t)_MIN(domain.ey + 1, height) * width;
+	hasher.add(positionMap.data() + (first - positionMap.first()), (last - first) * sizeof(*positionMap.data()));
+	hasher.add(geoNormalMap.data() + (first - geoNormalMap.first()), (last - first) * sizeof(*geoNormalMap.data()));
+	return hasher.value();
+}
+
+
+bool AppearanceSolver::loadCachedTBN(uint64 key)
+{
+	size_t count = 0;
+	auto file = openEntry(cachePath("tbn", key), key, sizeof(TangentFrame), count);
+	if (!file || count != (size_t)width * height)
+		return false;
+
+	const TangentFrame* frames = (const TangentFrame*)entryData(*file);
+	tbnMap.map(std::move(file), frames, count);
+	return true;
+}
+
+
+void AppearanceSolver::saveCachedTBN(uint64 key) const
+{
+	writeEntry(cachePath("tbn", key), key, tbnMap.data(), sizeof(TangentFrame), tbnMap.size());
+}
+
+
+// One bit per view for every texel of the domain, set where isValidPixel() holds and the weight exceeds viewWeightMin.
+// The masks are kept while the views and these options stay the same, and are cleared when the views are reloaded.
+void AppearanceSolver::prepareViewMasks()
+{
+	const int r = problemOpts.zeroRadius;
+	const int numViews = (int)views.size();
+
+	uint64 optionsKey = KeyHasher().add(width).add(height)
+		.add(domain.sx).add(domain.sy).add(domain.ex).add(domain.ey)
+		.add(r).add(problemOpts.viewWeightMin).add(numViews).value();
+	if (!viewMasks.empty() && optionsKey == viewMaskKey)
+		return;
+
+	viewMasks.clear();
+	viewMaskKey = optionsKey;
+	viewMaskWords = (numViews + 63) / 64;
+	if (numViews == 0)
+		return;
+
+	const int domainWidth = domain.ex - domain.sx;
+	const size_t area = domain.area();
+
+	// The windows of the domain reach r rows above and below it.
+	const int y0 = _MAX(domain.sy - r, 0);
+	const int y1 = _MIN(domain.ey + r, height);
+	const int x0 = _MAX(domain.sx - r, 0);
+	const int x1 = _MIN(domain.ex + r, width);
+
+	std::vector<uint64> viewHashes(numViews);
+	parallelFor(0, numViews, solverOptions.num_threads, [&](int v) {
+		const auto& view = views[v];
+		size_t viewBytes = view.trgViewMap.texelSize();
+		size_t weightBytes = view.weightMap.texelSize();
+		size_t viewFirst = (size_t)y0 * width - view.trgViewMap.first();
+		size_t weightFirst = (size_t)domain.sy * width - view.weightMap.first();
+		viewHashes[v] = KeyHasher().add(view.cameraId)
+			.add((const char*)view.trgViewMap.texelData() + viewFirst * viewBytes, (size_t)(y1 - y0) * width * viewBytes)
+			.add((const char*)view.weightMap.texelData() + weightFirst * weightBytes, (size_t)(domain.ey - domain.sy) * width * weightBytes)
+			.value();
+	});
+
+	KeyHasher hasher;
+	hasher.add(optionsKey).add(viewHashes.data(), viewHashes.size() * sizeof(uint64));
+	uint64 key = hasher.value();
+
+	std::string path = cachePath("views", key);
+	size_t count = 0;
+	if (auto file = openEntry(path, key, sizeof(uint64), count); file && count == area * viewMaskWords)
+	{
+		const uint64* masks = (const uint64*)entryData(*file);
+		viewMasks.map(std::move(file), masks, count);
+		return;
+	}
+
+	printf("Valid view computation...\n");
+
+	// Zero texels are counted along the rows with prefix sums, and then over the rows of each window,
+	// which replaces the (2r+1)^2 reads of isValidPixel() per texel and view.
+	std::vector<std::vector<uint8>> valid(numViews);
+	parallelFor(0, numViews, solverOptions.num_threads, [&](int v) {
+		const auto& view = views[v];
+		std::vector<int> prefix(x1 - x0 + 1, 0);
+		std::vector<int> rowZeros((size_t)(y1 - y0) * domainWidth);
+
+		for (int y = y0; y < y1; ++y)
+		{
+			for (int x = x0; x < x1; ++x)
+				prefix[x - x0 + 1] = prefix[x - x0] + (view.trgViewMap[y * width + x].isZero() ? 1 : 0);
+			for (int x = domain.sx; x < domain.ex; ++x)
+				rowZeros[(size_t)(y - y0) * domainWidth + x - domain.sx] =
+					prefix[_MIN(x + r, width - 1) - x0 + 1] - prefix[_MAX(x - r, 0) - x0];
+		}
+
+		valid[v].assign(area, 0);
+		for (int y = domain.sy; y < domain.ey; ++y)
+			for (int x = domain.sx; x < domain.ex; ++x)
+		{
+			int zeros = 0;
+			for (int i = _MAX(y - r, 0); i <= _MIN(y + r, height - 1); ++i)
+				zeros += rowZeros[(size_t)(i - y0) * domainWidth + x - domain.sx];
+
+			size_t local = (size_t)(y - domain.sy) * domainWidth + x - domain.sx;
+			valid[v][local] = zeros == 0 && view.weightMap[y * width + x] > problemOpts.viewWeightMin;
+		}
+	});
+
+	auto& masks = viewMasks.edit();
+	masks.assign(area * viewMaskWords, 0);
+	for (size_t local = 0; local < area; ++local)
+		for (int v = 0; v < numViews; ++v)
+			masks[local * viewMaskWords + v / 64] |= (uint64)valid[v][local] << (v % 64);
+
+	writeEntry(path, key, masks.data(), sizeof(uint64), masks.size());
+}
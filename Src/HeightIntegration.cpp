@@ -0,0 +1,221 @@
+#include "pch.h"
+#include "AppearanceSolver.h"
+#include <unsupported/Eigen/FFT>
+#include <complex>
+
+
+static constexpr int kMaxIntegrationIterations = 200;
+static constexpr double kIntegrationTolerance = 1e-6;
+
+
+// DCT-II (or its inverse) of every row of a row-major (rows x cols) array,
+// computed from the 2*cols-point FFT of the row's even extension.
+static void dctRows(std::vector<double>& data, int rows, int cols, bool inverse)
+{
+	Eigen::FFT<double> fft;
+	std::vector<double> line(2 * cols);
+	std::vector<std::complex<double>> spectrum(2 * cols);
+	std::vector<std::complex<double>> twiddle(cols);
+
+	for (int k = 0; k < cols; ++k)
+		twiddle[k] = std::polar(1.0, -PI * k / (2.0 * cols));
+
+	for (int r = 0; r < rows; ++r)
+	{
+		double* x = &data[(size_t)r * cols];
+		if (!inverse)
+		{
+			for (int n = 0; n < cols; ++n)
+				line[n] = line[2 * cols - 1 - n] = x[n];
+			fft.fwd(spectrum, line);
+			for (int k = 0; k < cols; ++k)
+				x[k] = 0.5 * (twiddle[k] * spectrum[k]).real();
+		}
+		else
+		{
+			spectrum[0] = 2.0 * x[0];
+			spectrum[cols] = 0.0;
+			for (int k = 1; k < cols; ++k)
+			{
+				spectrum[k] = 2.0 * x[k] * std::conj(twiddle[k]);
+				spectrum[2 * cols - k] = std::conj(spectrum[k]);
+			}
+			fft.inv(line, spectrum);
+			for (int n = 0; n < cols; ++n)
+				x[n] = line[n];
+		}
+	}
+}
+
+
+static void transpose(std::vector<double>& data, int rows, int cols)
+{
+	std::vector<double> out(data.size());
+	for (int r = 0; r < rows; ++r)
+		for (int c = 0; c < cols; ++c)
+			out[(size_t)c * rows + r] = data[(size_t)r * cols + c];
+	data.swap(out);
+}
+
+
+// Height differences (du, dv) at which constructNormal() reproduces the normal N in the frame tbn.
+static bool slopeFromNormal(NormalOptMode mode, const Eigen::Matrix3d& tbn, const Eigen::Vector3d& N, Eigen::Vector2d& slope)
+{
+	if (mode == NormalOptMode::heightmap)
+	{
+		// (T + du*Z) x (B + dv*Z) = T x B + du * Z x B + dv * T x Z must be parallel to N.
+		Eigen::Vector3d T = tbn.col(0);
+		Eigen::Vector3d B = tbn.col(1);
+		Eigen::Vector3d Z = tbn.col(2);
+		Eigen::Matrix3d M;
+		M << Z.cross(B), T.cross(Z), -N;
+		Eigen::Vector3d sol = M.colPivHouseholderQr().solve(-T.cross(B));
+		if (!sol.allFinite() || sol[2] <= 0.0)
+			return false;
+		slope = sol.head<2>();
+		return true;
+	}
+
+	// tbn * (-du, -dv, 1) must be parallel to N.
+	Eigen::Vector3d a = tbn.colPivHouseholderQr().solve(N);
+	if (!a.allFinite() || a[2] <= 0.2 * a.norm())
+		return false;
+	slope = Eigen::Vector2d(-a[0] / a[2], -a[1] / a[2]);
+	return true;
+}
+
+
+void AppearanceSolver::integrateHeight()
+{
+	const auto& opt = problemOpts;
+	if (heightMap.empty() || tbnMap.empty())
+		return;
+
+	printf("Integrating the height map from the normals...\n");
+
+	const int w = domain.ex - domain.sx;
+	const int h = domain.ey - domain.sy;
+	auto local = [&](int x, int y) { return (y - domain.sy) * w + (x - domain.sx); };
+
+	std::vector<Eigen::Vector2d> slopes(w * h, Eigen::Vector2d::Zero());
+	std::vector<uint8> valid(w * h, 0);
+
+	for (int p : domain)
+	{
+		if (geoNormalMap[p].norm() < 0.8 || normalMap[p].isZero())
+			continue;
+		int l = local(p % width, p / width);
+		valid[l] = slopeFromNormal(opt.normalMode, tbnMatrix(p), normalMap[p].normalized(), slopes[l]);
+	}
+
+	// Target difference across the edge from a to its neighbour b, following the stencil of the difference mode.
+	auto edgeTarget = [&](int a, int b, int axis) {
+		if (opt.diffMode == DifferenceMode::forward2)
+			return slopes[a][axis];
+		if (opt.diffMode == DifferenceMode::forward)
+			return slopes[b][axis];
+		return 0.5 * (slopes[a][axis] + slopes[b][axis]);
+	};
+
+	// Edges touching an invalid pixel have zero weight, so the fit ignores them and is a weighted Poisson problem
+	// A h = b, where A sums w_e (h_a - h_b) over the edges of a pixel.
+	std::vector<uint8> weightX(w * h, 0), weightY(w * h, 0);
+	Eigen::VectorXd rhs = Eigen::VectorXd::Zero(w * h);
+	for (int y = domain.sy; y < domain.ey; ++y)
+		for (int x = domain.sx; x < domain.ex; ++x)
+	{
+		int l = local(x, y);
+		if (x + 1 < domain.ex && valid[l] && valid[l + 1])
+		{
+			double g = edgeTarget(l, l + 1, 0);
+			weightX[l] = 1;
+			rhs[l] -= g;
+			rhs[l + 1] += g;
+		}
+		if (y + 1 < domain.ey && valid[l] && valid[l + w])
+		{
+			double g = edgeTarget(l, l + w, 1);
+			weightY[l] = 1;
+			rhs[l] -= g;
+			rhs[l + w] += g;
+		}
+	}
+
+	auto multiply = [&](const Eigen::VectorXd& v, Eigen::VectorXd& out) {
+		out.setZero();
+		for (int l = 0; l < w * h; ++l)
+		{
+			if (weightX[l])
+			{
+				double d = v[l] - v[l + 1];
+				out[l] += d;
+				out[l + 1] -= d;
+			}
+			if (weightY[l])
+			{
+				double d = v[l] - v[l + w];
+				out[l] += d;
+				out[l + w] -= d;
+			}
+		}
+	};
+
+	// The uniform Neumann Laplacian of the domain rectangle is diagonalized by DCT-II transforms, so its
+	// zero-mean solve is the preconditioner. Without a mask it is exact, and CG stops after one iteration.
+	std::vector<double> spectrum(w * h);
+	auto precondition = [&](const Eigen::VectorXd& r, Eigen::VectorXd& z) {
+		for (int l = 0; l < w * h; ++l)
+			spectrum[l] = r[l];
+
+		dctRows(spectrum, h, w, false);
+		transpose(spectrum, h, w);
+		dctRows(spectrum, w, h, false);
+
+		for (int k = 0; k < w; ++k)
+			for (int m = 0; m < h; ++m)
+		{
+			double eigenValue = 4.0 - 2.0 * std::cos(PI * k / w) - 2.0 * std::cos(PI * m / h);
+			spectrum[k * h + m] = (k == 0 && m == 0) ? 0.0 : spectrum[k * h + m] / eigenValue;
+		}
+
+		dctRows(spectrum, w, h, true);
+		transpose(spectrum, w, h);
+		dctRows(spectrum, h, w, true);
+
+		for (int l = 0; l < w * h; ++l)
+			z[l] = spectrum[l];
+	};
+
+	// The right hand side sums to zero over every connected valid region, so CG converges although
+	// the masked pixels and the offsets of separate regions are free.
+	Eigen::VectorXd height = Eigen::VectorXd::Zero(w * h);
+	Eigen::VectorXd r = rhs;
+	Eigen::VectorXd z(w * h), d(w * h), Ad(w * h);
+	precondition(r, z);
+	d = z;
+	double rz = r.dot(z);
+	const double threshold = kIntegrationTolerance * rhs.norm();
+
+	int iter = 0;
+	for (; iter < kMaxIntegrationIterations && r.norm() > threshold; ++iter)
+	{
+		multiply(d, Ad);
+		double dAd = d.dot(Ad);
+		if (dAd <= 0.0)
+			break;
+		double alpha = rz / dAd;
+		height += alpha * d;
+		r -= alpha * Ad;
+
+		precondition(r, z);
+		double rzNew = r.dot(z);
+		d = z + (rzNew / rz) * d;
+		rz = rzNew;
+	}
+	printf("Height integration converged to %e after %d CG iterations.\n", r.norm() / _MAX(rhs.norm(), DBL_MIN), iter);
+
+	for (int p : domain)
+		heightMap[p] = height[local(p % width, p / width)];
+
+	constructNormal();
+}
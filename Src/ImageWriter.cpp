@@ -0,0 +1,81 @@
+#include "pch.h"
+#include "ImageWriter.h"
+
+
+ImageWriter::ImageWriter(int numThreads, int capacity)
+	: capacity(std::max(capacity, 1))
+{
+	for (int t = 0; t < std::max(numThreads, 1); ++t)
+		threads.emplace_back(&ImageWriter::work, this);
+}
+
+
+ImageWriter::~ImageWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		bClosing = true;
+	}
+	jobQueued.notify_all();
+
+	// Queued jobs are still written before the threads leave.
+	for (auto& thread : threads)
+		thread.join();
+}
+
+
+void ImageWriter::work()
+{
+	TRACE_THREAD("image writer");
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		jobQueued.wait(lock, [this]() { return bClosing || !jobs.empty(); });
+		if (jobs.empty())
+			return;
+
+		Job job = std::move(jobs.front());
+		jobs.pop_front();
+		jobDone.notify_all();
+
+		lock.unlock();
+		job.func();
+		lock.lock();
+
+		--pending[job.tag];
+		jobDone.notify_all();
+	}
+}
+
+
+void ImageWriter::submit(std::function<void()> func, int tag)
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		jobDone.wait(lock, [this]() { return jobs.size() < capacity; });
+		jobs.push_back({ std::move(func), tag });
+		++pending[tag];
+	}
+	jobQueued.notify_one();
+}
+
+
+void ImageWriter::wait(int tag)
+{
+	TRACE_SCOPE("wait for image writers");
+	std::unique_lock<std::mutex> lock(mutex);
+	jobDone.wait(lock, [&]() { return pending[tag] == 0; });
+}
+
+
+void ImageWriter::flush()
+{
+	TRACE_SCOPE("wait for image writers");
+	std::unique_lock<std::mutex> lock(mutex);
+	jobDone.wait(lock, [this]() {
+		for (auto& [tag, count] : pending)
+			if (count > 0)
+				return false;
+		return true;
+	});
+}
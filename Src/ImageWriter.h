@@ -0,0 +1,39 @@
+#pragma once
+#include "pch.h"
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+
+// Runs the encoding and writing of output images on its own threads, so that recording does not hold up the solver.
+// Jobs carry the tag of the snapshot they read, and wait(tag) returns once that snapshot can be overwritten.
+class ImageWriter
+{
+	struct Job {
+		std::function<void()> func;
+		int tag;
+	};
+
+	std::vector<std::thread> threads;
+	std::deque<Job> jobs;
+	std::map<int, int> pending;
+	std::mutex mutex;
+	std::condition_variable jobQueued;
+	std::condition_variable jobDone;
+	const size_t capacity;
+	bool bClosing = false;
+
+	void work();
+
+public:
+	ImageWriter(int numThreads, int capacity);
+	~ImageWriter();
+	ImageWriter(const ImageWriter&) = delete;
+	ImageWriter& operator=(const ImageWriter&) = delete;
+
+	// Blocks while 'capacity' jobs are already queued.
+	void submit(std::function<void()> func, int tag = 0);
+
+	void wait(int tag);
+	void flush();
+};
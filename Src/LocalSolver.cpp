@@ -0,0 +1,253 @@
+#include "pch.h"
+#include "AppearanceSolver.h"
+#include "AccuracyCost.h"
+#include "utils.h"
+
+
+// diffuse RGB, specular and roughness
+static constexpr int kMaxLocalParams = 5;
+static constexpr int kMaxLocalAttempts = 6;
+
+using LocalJet = ceres::Jet<double, kMaxLocalParams>;
+using LocalVec = Eigen::Vector<double, kMaxLocalParams>;
+using LocalMat = Eigen::Matrix<double, kMaxLocalParams, kMaxLocalParams>;
+
+
+static bool isOptimized(Param param, ParamSpace params)
+{
+	switch (param)
+	{
+	case Param::diffuseR:
+	case Param::diffuseG:
+	case Param::diffuseB:
+		return params & ParamSpace::param_diffuse;
+	case Param::specular:
+		return params & ParamSpace::param_specular;
+	case Param::roughness:
+		return params & ParamSpace::param_roughness;
+	default:
+		return params & ParamSpace::param_normal;
+	}
+}
+
+
+bool AppearanceSolver::isPixelSeparable(ParamSpace params) const
+{
+	if (!params || (params & ParamSpace::param_normal))
+		return false;
+
+	// A constant parameter is one block shared by every pixel.
+	if ((params & ParamSpace::param_specular) && problemOpts.constantSpecular)
+		return false;
+	if ((params & ParamSpace::param_roughness) && problemOpts.constantRoughness)
+		return false;
+
+	// SmoothType::zero only pulls a pixel towards the base, the others couple neighbours.
+	for (auto& [param_type, weight_exp] : problemOpts.smoothWeightAndExp)
+	{
+		auto& [param, smoothType] = param_type;
+		if (smoothType != SmoothType::zero && weight_exp.first > 0.0 && isOptimized(param, params))
+			return false;
+	}
+	return true;
+}
+
+
+SolverEngine AppearanceSolver::resolveEngine(ParamSpace params) const
+{
+	switch (engine)
+	{
+	case SolverEngine::automatic:
+	case SolverEngine::local:
+		return isPixelSeparable(params) ? SolverEngine::local : SolverEngine::ceres;
+
+	case SolverEngine::matrixFree:
+		// A constant parameter is a dense column that the stripe-parallel products cannot accumulate.
+		if (((params & ParamSpace::param_specular) && problemOpts.constantSpecular) ||
+			((params & ParamSpace::param_roughness) && problemOpts.constantRoughness))
+			return SolverEngine::ceres;
+		return SolverEngine::matrixFree;
+
+	default:
+		return SolverEngine::ceres;
+	}
+}
+
+
+void AppearanceSolver::solveLocally(ParamSpace params)
+{
+	const auto& opt = problemOpts;
+
+	std::vector<Param> slots;
+	if (params & ParamSpace::param_diffuse)
+		slots.insert(slots.end(), { Param::diffuseR, Param::diffuseG, Param::diffuseB });
+	if (params & ParamSpace::param_specular)
+		slots.push_back(Param::specular);
+	if (params & ParamSpace::param_roughness)
+		slots.push_back(Param::roughness);
+	const int n = (int)slots.size();
+
+	double lb[kMaxLocalParams];
+	double ub[kMaxLocalParams];
+	for (int k = 0; k < n; ++k)
+	{
+		lb[k] = -DBL_MAX;
+		ub[k] = DBL_MAX;
+		if (auto it = opt.bounds.find(slots[k]); it != opt.bounds.end())
+		{
+			if (it->second.first != DBL_MAX)  lb[k] = it->second.first;
+			if (it->second.second != DBL_MIN) ub[k] = it->second.second;
+		}
+	}
+
+	struct Prior {
+		int k;
+		double weight;
+		double exp;
+		double base;
+	};
+	std::vector<Prior> priors;
+	for (auto& [param_type, weight_exp] : opt.smoothWeightAndExp)
+	{
+		auto& [param, smoothType] = param_type;
+		auto& [weight, exp] = weight_exp;
+		auto slot = std::find(slots.begin(), slots.end(), param);
+		if (smoothType == SmoothType::zero && weight > 0.0 && slot != slots.end())
+			priors.push_back({ (int)(slot - slots.begin()), weight, exp, opt.base[(int)param] });
+	}
+
+	auto slotPtr = [this, &slots](int p, int k) -> double* {
+		switch (slots[k])
+		{
+		case Param::diffuseR:	return &diffuseMap[p][0];
+		case Param::diffuseG:	return &diffuseMap[p][1];
+		case Param::diffuseB:	return &diffuseMap[p][2];
+		case Param::specular:	return &specularMap[p];
+		default:				return &roughnessMap[p];
+		}
+	};
+
+	// Same residuals as createProblem() adds for one pixel: the weighted views and the zero-type priors.
+	auto evaluatePixel = [&]<typename T>(int p, const std::vector<std::pair<int, double>>& frames, T* x, std::vector<T>& r)
+	{
+		r.clear();
+		for (auto& [v, weight] : frames)
+		{
+			AccuracyCost cost(*this, v, p, weight, params);
+			T res[3];
+			switch (n)
+			{
+			case 1: cost(x, res); break;
+			case 2: cost(x, x + 1, res); break;
+			case 3: cost(x, x + 1, x + 2, res); break;
+			case 4: cost(x, x + 1, x + 2, x + 3, res); break;
+			case 5: cost(x, x + 1, x + 2, x + 3, x + 4, res); break;
+			}
+			r.insert(r.end(), res, res + 3);
+		}
+		for (auto& prior : priors)
+			r.push_back(prior.weight * ceres::pow(x[prior.k] - prior.base, prior.exp));
+	};
+
+	const int domainWidth = domain.ex - domain.sx;
+	const double tolerance = solverOptions.function_tolerance;
+	std::vector<double> lambdas(domain.area(), 1e-4);
+	std::vector<double> pixelCosts(domain.area(), 0.0);
+	std::vector<uint8> converged(domain.area(), 0);
+
+	auto stepPixel = [&](int p, int local) {
+		std::vector<double> frameWeights;
+		double total_weight = computeViewWeights(p, frameWeights);
+		if (total_weight == 0.0)
+		{
+			converged[local] = 1;
+			return;
+		}
+
+		std::vector<std::pair<int, double>> frames;
+		for (int v = 0; v < (int)views.size(); ++v)
+			if (frameWeights[v] > 0.0)
+				frames.emplace_back(v, std::sqrt(frameWeights[v] / total_weight));
+
+		double x0[kMaxLocalParams];
+		LocalJet xj[kMaxLocalParams];
+		for (int k = 0; k < n; ++k)
+		{
+			x0[k] = *slotPtr(p, k);
+			xj[k] = LocalJet(x0[k], k);
+		}
+
+		std::vector<LocalJet> rj;
+		evaluatePixel(p, frames, xj, rj);
+
+		double cost = 0.0;
+		LocalMat JtJ = LocalMat::Zero();
+		LocalVec Jtr = LocalVec::Zero();
+		for (const auto& r : rj)
+		{
+			cost += 0.5 * r.a * r.a;
+			JtJ += r.v * r.v.transpose();
+			Jtr += r.a * r.v;
+		}
+
+		double lambda = lambdas[local];
+		std::vector<double> r;
+		for (int attempt = 0; attempt < kMaxLocalAttempts; ++attempt, lambda *= 4.0)
+		{
+			LocalMat H = JtJ;
+			for (int k = 0; k < kMaxLocalParams; ++k)
+				H(k, k) = (k < n) ? H(k, k) + lambda * _MAX(JtJ(k, k), 1e-6) : 1.0;
+			LocalVec delta = H.ldlt().solve(-Jtr);
+
+			double x1[kMaxLocalParams];
+			for (int k = 0; k < n; ++k)
+				x1[k] = std::clamp(x0[k] + delta[k], lb[k], ub[k]);
+
+			evaluatePixel(p, frames, x1, r);
+			double newCost = 0.0;
+			for (double ri : r)
+				newCost += 0.5 * ri * ri;
+
+			if (newCost < cost)
+			{
+				for (int k = 0; k < n; ++k)
+					*slotPtr(p, k) = x1[k];
+				lambdas[local] = _MAX(lambda / 3.0, 1e-12);
+				pixelCosts[local] = newCost;
+				converged[local] = (cost - newCost) <= tolerance * cost;
+				return;
+			}
+		}
+
+		// No step within the damping range reduces the cost any more.
+		lambdas[local] = lambda;
+		pixelCosts[local] = cost;
+		converged[local] = 1;
+	};
+
+	printf("Solving %d pixels locally with %d parameters each.\n", domain.area(), n);
+
+	ceres::IterationSummary summary;
+	if ((*this)(summary) != ceres::SOLVER_CONTINUE)
+		return;
+
+	for (int iter = 1; iter <= solverOptions.max_num_iterations; ++iter)
+	{
+		parallelFor(domain.sy, domain.ey, solverOptions.num_threads, [&](int i) {
+			for (int j = domain.sx; j < domain.ex; ++j)
+			{
+				int local = (i - domain.sy) * domainWidth + (j - domain.sx);
+				if (!converged[local])
+					stepPixel(i * width + j, local);
+			}
+		});
+
+		int numConverged = (int)std::count(converged.begin(), converged.end(), 1);
+		summary.iteration = iter;
+		summary.cost = std::accumulate(pixelCosts.begin(), pixelCosts.end(), 0.0);
+		printf("Local iteration %d : cost = %e, converged pixels = %d / %d\n", iter, summary.cost, numConverged, domain.area());
+
+		if ((*this)(summary) != ceres::SOLVER_CONTINUE || numConverged == domain.area())
+			break;
+	}
+}
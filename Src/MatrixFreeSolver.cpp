@@ -0,0 +1,366 @@
+#include "pch.h"
+#include "AppearanceSolver.h"
+#include "utils.h"
+
+
+// The residuals of a pixel reach its direct neighbours only, so stripes of at least
+// this many rows that are two apart never write to the same unknown.
+static constexpr int kMinStripeHeight = 3;
+static constexpr int kMaxStepAttempts = 6;
+// AccuracyCost has three residuals, and no smoothness term has more.
+static constexpr int kMaxResiduals = 3;
+
+
+namespace {
+
+struct MapRange {
+	double* data;
+	int size;
+	int elementSize;
+	Param param;
+	std::vector<int> index = {};
+};
+
+// One residual block evaluated at the current maps, with the Jacobian columns of its unknowns.
+struct Linearization {
+	std::vector<double> r;
+	std::vector<std::vector<double>> blockJacobians;
+	std::vector<double*> jacobianPtrs;
+	std::vector<int> vars;
+	std::vector<const double*> cols;
+	std::vector<int> strides;
+
+	// Ceres stores each block Jacobian row-major, so a column is strided by its block size.
+	double column(int k, int i) const { return cols[k][i * strides[k]]; }
+};
+
+}
+
+
+void AppearanceSolver::solveMatrixFree(ParamSpace params)
+{
+	const auto& opt = problemOpts;
+
+	std::vector<MapRange> maps;
+	if (params & ParamSpace::param_diffuse)
+		maps.push_back({ diffuseMap[0].data(), 3 * (int)diffuseMap.size(), 3, Param::diffuseR });
+	if (params & ParamSpace::param_specular)
+		maps.push_back({ specularMap.data(), (int)specularMap.size(), 1, Param::specular });
+	if (params & ParamSpace::param_roughness)
+		maps.push_back({ roughnessMap.data(), (int)roughnessMap.size(), 1, Param::roughness });
+	if (params & ParamSpace::param_normal)
+	{
+		if (opt.normalMode == NormalOptMode::raw_normal)
+			maps.push_back({ normalMap[0].data(), 3 * (int)normalMap.size(), 3, Param::MAX });
+		else if (opt.normalMode == NormalOptMode::raw_normal2D)
+			maps.push_back({ sphereMap[0].data(), 2 * (int)sphereMap.size(), 2, Param::sphere });
+		else
+			maps.push_back({ heightMap.data(), (int)heightMap.size(), 1, Param::height });
+	}
+
+	auto findMap = [&maps](const double* x) -> MapRange* {
+		for (auto& map : maps)
+			if (map.data <= x && x < map.data + map.size)
+				return &map;
+		return nullptr;
+	};
+
+	// Every scalar that some residual block touches becomes an unknown, numbered in memory order of its map.
+	for (auto& map : maps)
+		map.index.assign(map.size, -1);
+
+	for (int p : domain)
+	{
+		visitResidualBlocks(p, params, [&](ceres::CostFunction* cost, const std::vector<double*>& blockParams) {
+			const auto& sizes = cost->parameter_block_sizes();
+			for (int b = 0; b < (int)blockParams.size(); ++b)
+				if (MapRange* map = findMap(blockParams[b]))
+					for (int c = 0; c < sizes[b]; ++c)
+						map->index[blockParams[b] + c - map->data] = 0;
+			delete cost;
+		});
+	}
+
+	// The unknowns of one map element, e.g. the RGB of a diffuse texel, form one block of the preconditioner.
+	std::vector<double*> x;
+	std::vector<double> lb, ub;
+	std::vector<int> varBlock, varOffset;
+	std::vector<int> blockStart;
+
+	for (auto& map : maps)
+	{
+		for (int e = 0; e < map.size; e += map.elementSize)
+		{
+			int start = (int)x.size();
+			for (int c = 0; c < map.elementSize; ++c)
+			{
+				if (map.index[e + c] < 0)
+					continue;
+
+				Param param = (map.param == Param::diffuseR) ? (Param)((int)Param::diffuseR + c) : map.param;
+				double lower = -DBL_MAX;
+				double upper = DBL_MAX;
+				if (auto it = opt.bounds.find(param); it != opt.bounds.end())
+				{
+					if (it->second.first != DBL_MAX)  lower = it->second.first;
+					if (it->second.second != DBL_MIN) upper = it->second.second;
+				}
+
+				map.index[e + c] = (int)x.size();
+				x.push_back(map.data + e + c);
+				lb.push_back(lower);
+				ub.push_back(upper);
+				varBlock.push_back((int)blockStart.size());
+				varOffset.push_back((int)x.size() - 1 - start);
+			}
+			if ((int)x.size() > start)
+				blockStart.push_back(start);
+		}
+	}
+
+	const int n = (int)x.size();
+	const int numBlocks = (int)blockStart.size();
+	blockStart.push_back(n);
+
+	printf("Solving %d unknowns matrix-free in %d blocks.\n", n, numBlocks);
+	if (n == 0)
+		return;
+
+	auto indexOf = [&](const double* ptr) {
+		MapRange* map = findMap(ptr);
+		return map ? map->index[ptr - map->data] : -1;
+	};
+
+	auto evaluate = [&](ceres::CostFunction* cost, const std::vector<double*>& blockParams, Linearization& lin, bool withJacobian) {
+		const auto& sizes = cost->parameter_block_sizes();
+		const int m = cost->num_residuals();
+		lin.r.resize(m);
+		lin.vars.clear();
+		lin.cols.clear();
+		lin.strides.clear();
+
+		if (!withJacobian)
+		{
+			cost->Evaluate(blockParams.data(), lin.r.data(), nullptr);
+			return;
+		}
+
+		lin.blockJacobians.resize(_MAX(lin.blockJacobians.size(), blockParams.size()));
+		lin.jacobianPtrs.resize(blockParams.size());
+		for (int b = 0; b < (int)blockParams.size(); ++b)
+		{
+			lin.blockJacobians[b].resize(m * sizes[b]);
+			lin.jacobianPtrs[b] = lin.blockJacobians[b].data();
+		}
+		cost->Evaluate(blockParams.data(), lin.r.data(), lin.jacobianPtrs.data());
+
+		for (int b = 0; b < (int)blockParams.size(); ++b)
+			for (int c = 0; c < sizes[b]; ++c)
+			{
+				int k = indexOf(blockParams[b] + c);
+				if (k >= 0)
+				{
+					lin.vars.push_back(k);
+					lin.cols.push_back(lin.blockJacobians[b].data() + c);
+					lin.strides.push_back(sizes[b]);
+				}
+			}
+	};
+
+	// Runs visit(p, stripe, lin) for every pixel, the even stripes in parallel and then the odd ones.
+	const int rows = domain.ey - domain.sy;
+	const int stripeHeight = _MAX(kMinStripeHeight, rows / _MAX(2 * solverOptions.num_threads, 1));
+	const int numStripes = (rows + stripeHeight - 1) / stripeHeight;
+
+	auto sweep = [&](auto&& visit) {
+		for (int parity = 0; parity < 2; ++parity)
+		{
+			parallelFor(0, (numStripes + 1 - parity) / 2, solverOptions.num_threads, [&](int s) {
+				int stripe = 2 * s + parity;
+				int ey = _MIN(domain.sy + (stripe + 1) * stripeHeight, domain.ey);
+				Linearization lin;
+				for (int i = domain.sy + stripe * stripeHeight; i < ey; ++i)
+					for (int j = domain.sx; j < domain.ex; ++j)
+						visit(i * width + j, stripe, lin);
+			});
+		}
+	};
+
+	// Cost, gradient J^T r and the diagonal blocks of J^T J at the current maps.
+	Eigen::VectorXd gradient(n);
+	std::vector<Eigen::Matrix3d> diagBlocks(numBlocks);
+	std::vector<double> stripeCosts(numStripes);
+
+	auto linearize = [&]() {
+		gradient.setZero();
+		std::fill(diagBlocks.begin(), diagBlocks.end(), Eigen::Matrix3d::Zero());
+		std::fill(stripeCosts.begin(), stripeCosts.end(), 0.0);
+
+		sweep([&](int p, int stripe, Linearization& lin) {
+			visitResidualBlocks(p, params, [&](ceres::CostFunction* cost, const std::vector<double*>& blockParams) {
+				evaluate(cost, blockParams, lin, true);
+				const int m = (int)lin.r.size();
+
+				for (int i = 0; i < m; ++i)
+					stripeCosts[stripe] += 0.5 * lin.r[i] * lin.r[i];
+
+				for (int a = 0; a < (int)lin.vars.size(); ++a)
+				{
+					int ka = lin.vars[a];
+					for (int i = 0; i < m; ++i)
+						gradient[ka] += lin.column(a, i) * lin.r[i];
+
+					for (int b = 0; b < (int)lin.vars.size(); ++b)
+					{
+						int kb = lin.vars[b];
+						if (varBlock[ka] != varBlock[kb])
+							continue;
+						double sum = 0.0;
+						for (int i = 0; i < m; ++i)
+							sum += lin.column(a, i) * lin.column(b, i);
+						diagBlocks[varBlock[ka]](varOffset[ka], varOffset[kb]) += sum;
+					}
+				}
+				delete cost;
+			});
+		});
+
+		return std::accumulate(stripeCosts.begin(), stripeCosts.end(), 0.0);
+	};
+
+	auto evaluateCost = [&]() {
+		std::fill(stripeCosts.begin(), stripeCosts.end(), 0.0);
+		sweep([&](int p, int stripe, Linearization& lin) {
+			visitResidualBlocks(p, params, [&](ceres::CostFunction* cost, const std::vector<double*>& blockParams) {
+				evaluate(cost, blockParams, lin, false);
+				for (double r : lin.r)
+					stripeCosts[stripe] += 0.5 * r * r;
+				delete cost;
+			});
+		});
+		return std::accumulate(stripeCosts.begin(), stripeCosts.end(), 0.0);
+	};
+
+	// out = (J^T J + lambda D) v, where J is re-evaluated residual by residual instead of being stored.
+	auto multiply = [&](const Eigen::VectorXd& v, Eigen::VectorXd& out, double lambda) {
+		out.setZero();
+		sweep([&](int p, int, Linearization& lin) {
+			visitResidualBlocks(p, params, [&](ceres::CostFunction* cost, const std::vector<double*>& blockParams) {
+				evaluate(cost, blockParams, lin, true);
+				const int m = (int)lin.r.size();
+
+				double Jv[kMaxResiduals] = {};
+				for (int a = 0; a < (int)lin.vars.size(); ++a)
+					for (int i = 0; i < m; ++i)
+						Jv[i] += lin.column(a, i) * v[lin.vars[a]];
+
+				for (int a = 0; a < (int)lin.vars.size(); ++a)
+					for (int i = 0; i < m; ++i)
+						out[lin.vars[a]] += lin.column(a, i) * Jv[i];
+				delete cost;
+			});
+		});
+
+		for (int k = 0; k < n; ++k)
+		{
+			const auto& D = diagBlocks[varBlock[k]];
+			out[k] += lambda * _MAX(D(varOffset[k], varOffset[k]), 1e-6) * v[k];
+		}
+	};
+
+	// Preconditioned conjugate gradients on the damped normal equations, with the inverted diagonal blocks.
+	auto solveStep = [&](double lambda, Eigen::VectorXd& delta) {
+		std::vector<Eigen::Matrix3d> inverses(numBlocks);
+		for (int b = 0; b < numBlocks; ++b)
+		{
+			int size = blockStart[b + 1] - blockStart[b];
+			Eigen::Matrix3d H = Eigen::Matrix3d::Identity();
+			H.topLeftCorner(size, size) = diagBlocks[b].topLeftCorner(size, size);
+			for (int c = 0; c < size; ++c)
+				H(c, c) += lambda * _MAX(diagBlocks[b](c, c), 1e-6);
+			inverses[b] = H.inverse();
+		}
+
+		auto precondition = [&](const Eigen::VectorXd& r, Eigen::VectorXd& z) {
+			for (int b = 0; b < numBlocks; ++b)
+			{
+				int start = blockStart[b];
+				int size = blockStart[b + 1] - start;
+				z.segment(start, size) = inverses[b].topLeftCorner(size, size) * r.segment(start, size);
+			}
+		};
+
+		delta.setZero(n);
+		Eigen::VectorXd r = -gradient;
+		Eigen::VectorXd z(n), d(n), Ad(n);
+		precondition(r, z);
+		d = z;
+		double rz = r.dot(z);
+		const double threshold = solverOptions.eta * gradient.norm();
+
+		int iter = 0;
+		for (; iter < solverOptions.max_linear_solver_iterations; ++iter)
+		{
+			multiply(d, Ad, lambda);
+			double alpha = rz / d.dot(Ad);
+			delta += alpha * d;
+			r -= alpha * Ad;
+			if (r.norm() <= threshold)
+				break;
+
+			precondition(r, z);
+			double rzNew = r.dot(z);
+			d = z + (rzNew / rz) * d;
+			rz = rzNew;
+		}
+		return iter + 1;
+	};
+
+	ceres::IterationSummary summary;
+	summary.cost = evaluateCost();
+	if ((*this)(summary) != ceres::SOLVER_CONTINUE)
+		return;
+
+	double lambda = 1.0 / solverOptions.initial_trust_region_radius;
+	Eigen::VectorXd x0(n), delta(n);
+
+	for (int iter = 1; iter <= solverOptions.max_num_iterations; ++iter)
+	{
+		double cost = linearize();
+		if (gradient.lpNorm<Eigen::Infinity>() <= solverOptions.gradient_tolerance)
+			break;
+
+		for (int k = 0; k < n; ++k)
+			x0[k] = *x[k];
+
+		bool accepted = false;
+		double newCost = cost;
+		int cgIters = 0;
+		for (int attempt = 0; attempt < kMaxStepAttempts && !accepted; ++attempt)
+		{
+			cgIters = solveStep(lambda, delta);
+			for (int k = 0; k < n; ++k)
+				*x[k] = std::clamp(x0[k] + delta[k], lb[k], ub[k]);
+
+			newCost = evaluateCost();
+			accepted = newCost < cost;
+			if (accepted)
+				lambda = _MAX(lambda / 3.0, 1e-12);
+			else
+			{
+				for (int k = 0; k < n; ++k)
+					*x[k] = x0[k];
+				lambda *= 4.0;
+			}
+		}
+
+		summary.iteration = iter;
+		summary.cost = accepted ? newCost : cost;
+		summary.trust_region_radius = 1.0 / lambda;
+		printf("Matrix-free iteration %d : cost = %e, CG iterations = %d, lambda = %e\n", iter, summary.cost, cgIters, lambda);
+
+		if ((*this)(summary) != ceres::SOLVER_CONTINUE || !accepted ||
+			(cost - newCost) <= solverOptions.function_tolerance * cost)
+			break;
+	}
+}
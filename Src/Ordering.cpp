@@ -0,0 +1,123 @@
+#include "pch.h"
+#include "AppearanceSolver.h"
+
+
+static constexpr int kLeafArea = 256;
+
+
+// Nested dissection of the rectangle [sx, ex) x [sy, ey): each bisection line is a separator,
+// and a pixel gets the depth of the first separator it lies on, or -1 inside a leaf.
+static int dissectionDepth(int x, int y, int sx, int sy, int ex, int ey)
+{
+	for (int depth = 0; (ex - sx) * (ey - sy) > kLeafArea; ++depth)
+	{
+		if (ex - sx >= ey - sy)
+		{
+			int mid = (sx + ex) / 2;
+			if (x == mid)
+				return depth;
+			if (x < mid)
+				ex = mid;
+			else
+				sx = mid + 1;
+		}
+		else
+		{
+			int mid = (sy + ey) / 2;
+			if (y == mid)
+				return depth;
+			if (y < mid)
+				ey = mid;
+			else
+				sy = mid + 1;
+		}
+	}
+	return -1;
+}
+
+
+void AppearanceSolver::configureLinearSolver(ceres::Problem* problem, ParamSpace params)
+{
+	if (!bGridOrdering)
+		return;
+
+	const auto& opt = problemOpts;
+
+	// Problems without height blocks keep the linear solver of the caller.
+	if (!(params & ParamSpace::param_normal) ||
+		opt.normalMode == NormalOptMode::raw_normal ||
+		opt.normalMode == NormalOptMode::raw_normal2D)
+		return;
+
+	// The per-pixel appearance can be Schur-eliminated only if it forms an independent set,
+	// i.e. one block per pixel that no smoothness term shares with a neighbour.
+	std::vector<Param> perPixel;
+	if (params & ParamSpace::param_diffuse)
+		perPixel.insert(perPixel.end(), { Param::diffuseR, Param::diffuseG, Param::diffuseB });
+	if ((params & ParamSpace::param_specular) && !opt.constantSpecular)
+		perPixel.push_back(Param::specular);
+	if ((params & ParamSpace::param_roughness) && !opt.constantRoughness)
+		perPixel.push_back(Param::roughness);
+
+	bool useSchur = perPixel.size() == 1;
+	for (auto& [param_type, weight_exp] : opt.smoothWeightAndExp)
+	{
+		auto& [param, smoothType] = param_type;
+		if (smoothType != SmoothType::zero && weight_exp.first > 0.0 &&
+			std::find(perPixel.begin(), perPixel.end(), param) != perPixel.end())
+			useSchur = false;
+	}
+
+	std::vector<double*> blocks;
+	problem->GetParameterBlocks(&blocks);
+
+	std::vector<std::pair<double*, int>> heightBlocks;
+	std::vector<double*> sharedBlocks;
+	int maxDepth = 0;
+
+	auto ordering = std::make_shared<ceres::ParameterBlockOrdering>();
+
+	for (double* x : blocks)
+	{
+		if (heightMap.data() <= x && x < heightMap.data() + heightMap.size())
+		{
+			// The stencils reach one pixel outside the domain, so the dissection covers that halo as well.
+			int p = (int)(x - heightMap.data());
+			int depth = dissectionDepth(p % width, p / width, domain.sx - 1, domain.sy - 1, domain.ex + 1, domain.ey + 1);
+			maxDepth = _MAX(maxDepth, depth);
+			heightBlocks.emplace_back(x, depth);
+		}
+		else if ((opt.constantSpecular && x == &specularMap[0]) || (opt.constantRoughness && x == &roughnessMap[0]))
+		{
+			sharedBlocks.push_back(x);
+		}
+		else
+		{
+			ordering->AddElementToGroup(x, 0);
+		}
+	}
+
+	if (heightBlocks.empty())
+		return;
+
+	// Leaves first, then separators from the deepest up to the one splitting the whole domain,
+	// and the blocks shared by every pixel last as they are dense columns.
+	for (auto& [x, depth] : heightBlocks)
+		ordering->AddElementToGroup(x, depth < 0 ? 1 : 2 + (maxDepth - depth));
+	for (double* x : sharedBlocks)
+		ordering->AddElementToGroup(x, 3 + maxDepth);
+
+	solverOptions.linear_solver_type = useSchur ? ceres::SPARSE_SCHUR : ceres::SPARSE_NORMAL_CHOLESKY;
+	solverOptions.linear_solver_ordering = ordering;
+
+	// Only SuiteSparse honours the groups beyond the first one, through its constrained AMD.
+	static bool bWarned = false;
+	if (solverOptions.sparse_linear_algebra_library_type != ceres::SUITE_SPARSE && !bWarned)
+	{
+		bWarned = true;
+		printf("[WARNING] The nested dissection groups are ignored without SuiteSparse.\n");
+	}
+
+	printf("Linear solver : %s with %d elimination groups\n",
+		useSchur ? "SPARSE_SCHUR" : "SPARSE_NORMAL_CHOLESKY", ordering->NumGroups());
+}
@@ -0,0 +1,222 @@
+#include "pch.h"
+#include "AppearanceSolver.h"
+
+
+template<typename T>
+static T sampleBilinear(const std::vector<T>& map, int width, int height, double x, double y)
+{
+	x = std::clamp(x, 0.0, width - 1.0);
+	y = std::clamp(y, 0.0, height - 1.0);
+
+	int x0 = (int)x;
+	int y0 = (int)y;
+	int x1 = _MIN(x0 + 1, width - 1);
+	int y1 = _MIN(y0 + 1, height - 1);
+	double fx = x - x0;
+	double fy = y - y0;
+
+	T top    = map[y0 * width + x0] * (1.0 - fx) + map[y0 * width + x1] * fx;
+	T bottom = map[y1 * width + x0] * (1.0 - fx) + map[y1 * width + x1] * fx;
+	return top * (1.0 - fy) + bottom * fy;
+}
+
+
+// A coarse texel covers the 2x2 block of fine texels starting at (2x, 2y).
+static std::array<int, 4> fineBlock(int x, int y, int fineWidth, int fineHeight)
+{
+	int x0 = _MIN(2 * x, fineWidth - 1);
+	int y0 = _MIN(2 * y, fineHeight - 1);
+	int x1 = _MIN(x0 + 1, fineWidth - 1);
+	int y1 = _MIN(y0 + 1, fineHeight - 1);
+	return { y0 * fineWidth + x0, y0 * fineWidth + x1, y1 * fineWidth + x0, y1 * fineWidth + x1 };
+}
+
+
+void AppearanceSolver::downsampleInputData(const AppearanceSolver& fine)
+{
+	printf("Downsampling input data to %dx%d...\n", width, height);
+
+	lightSamples = fine.lightSamples;
+	disabledCameras = fine.disabledCameras;
+	storageOpts = fine.storageOpts;
+	problemOpts = fine.problemOpts;
+	problemOpts.zeroRadius = (fine.problemOpts.zeroRadius + 1) / 2;
+	recordOpts.viewIdices = fine.recordOpts.viewIdices;
+
+	// The fine inputs may hold only the rows around the domain, and coarse texels beyond them are left uncaptured.
+	auto loaded = [&](const std::array<int, 4>& block) {
+		return fine.positionMap.contains(block[0]) && fine.positionMap.contains(block[3]);
+	};
+
+	auto& positions = positionMap.edit();
+	auto& geoNormals = geoNormalMap.edit();
+	positions.resize(width * height);
+	geoNormals.resize(width * height);
+
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width; ++x)
+	{
+		int p = y * width + x;
+		auto block = fineBlock(x, y, fine.width, fine.height);
+		if (!loaded(block))
+		{
+			positions[p] = Eigen::Vector4f::Zero();
+			geoNormals[p] = Eigen::Vector4f::Zero();
+			continue;
+		}
+
+		Eigen::Vector3d position = Eigen::Vector3d::Zero();
+		Eigen::Vector3d geoNormal = Eigen::Vector3d::Zero();
+		bool validNormal = true;
+		for (int q : block)
+		{
+			position += 0.25 * fine.positionMap[q];
+			geoNormal += fine.geoNormalMap[q];
+			validNormal &= fine.geoNormalMap[q].norm() >= 0.8;
+		}
+
+		// Keep invalid texels invalid so that computeTBNMatrix() skips them as it does at full resolution.
+		positions[p] = toTexel(position);
+		geoNormals[p] = toTexel(validNormal ? geoNormal.normalized() : Eigen::Vector3d::Zero());
+	}
+
+	views.clear();
+	views.reserve(fine.views.size());
+
+	for (const auto& fineView : fine.views)
+	{
+		ViewData view;
+		view.cameraId = fineView.cameraId;
+		view.cameraPos = fineView.cameraPos;
+		auto& trgViewMap = view.trgViewMap.stored().edit();
+		auto& weightMap = view.weightMap.stored().edit();
+		trgViewMap.resize(width * height);
+		weightMap.resize(width * height);
+
+		for (int y = 0; y < height; ++y)
+			for (int x = 0; x < width; ++x)
+		{
+			int p = y * width + x;
+			auto block = fineBlock(x, y, fine.width, fine.height);
+
+			if (!loaded(block))
+			{
+				trgViewMap[p] = Eigen::Vector4f::Zero();
+				weightMap[p] = 0.0f;
+				continue;
+			}
+
+			Eigen::Vector3d radiance = Eigen::Vector3d::Zero();
+			double weight = 0.0;
+			bool covered = true;
+			for (int q : block)
+			{
+				radiance += 0.25 * fineView.trgViewMap[q];
+				weight += 0.25 * fineView.weightMap[q];
+				covered &= !fineView.trgViewMap[q].isZero();
+			}
+
+			// A texel touching an uncaptured fine texel stays uncaptured, which keeps isValidPixel() conservative.
+			trgViewMap[p] = toTexel(covered ? radiance : Eigen::Vector3d::Zero());
+			weightMap[p] = toTexel(weight);
+		}
+
+		if (storageOpts.bHalfViews)
+		{
+			view.trgViewMap.reducePrecision();
+			view.weightMap.reducePrecision();
+		}
+
+		views.push_back(std::move(view));
+	}
+
+	// A light is visible from a coarse texel when it is visible from at least two of its four fine texels.
+	shadowTable.clear();
+	if (!fine.shadowTable.empty())
+	{
+		int numWords = fine.shadowTable.words();
+		auto& shadows = shadowTable.edit(width * height, numWords);
+		uint scratch[4][ShadowTable::kMaxWords];
+
+		for (int y = 0; y < height; ++y)
+			for (int x = 0; x < width; ++x)
+		{
+			auto block = fineBlock(x, y, fine.width, fine.height);
+			if (!loaded(block))
+				continue;
+
+			const uint* a = fine.shadowTable.texel(block[0], scratch[0]);
+			const uint* b = fine.shadowTable.texel(block[1], scratch[1]);
+			const uint* c = fine.shadowTable.texel(block[2], scratch[2]);
+			const uint* d = fine.shadowTable.texel(block[3], scratch[3]);
+			for (int i = 0; i < numWords; ++i)
+				shadows[(y * width + x) * numWords + i] =
+					(a[i] & b[i]) | (a[i] & c[i]) | (a[i] & d[i]) | (b[i] & c[i]) | (b[i] & d[i]) | (c[i] & d[i]);
+		}
+
+		if (storageOpts.bCompressedShadows)
+			shadowTable.compress(solverOptions.num_threads);
+	}
+
+	normalMap = geoNormalMap.toVector(width * height);
+	loadedWindow = { 0, height, 0, width };
+	solverState = invalidSolution;
+}
+
+
+void AppearanceSolver::upsampleSolution(const AppearanceSolver& coarse)
+{
+	// Height differences are measured per texel against unit tangents in heightmap2018,
+	// so the same slope needs twice the height once a coarse texel is split in two.
+	double heightScale = (problemOpts.normalMode == NormalOptMode::heightmap2018) ? 2.0 : 1.0;
+
+	for (int p : domain)
+	{
+		double x = ((p % width) + 0.5) * coarse.width / width - 0.5;
+		double y = ((p / width) + 0.5) * coarse.height / height - 0.5;
+
+		diffuseMap[p] = sampleBilinear(coarse.diffuseMap, coarse.width, coarse.height, x, y);
+		specularMap[p] = sampleBilinear(coarse.specularMap, coarse.width, coarse.height, x, y);
+		roughnessMap[p] = sampleBilinear(coarse.roughnessMap, coarse.width, coarse.height, x, y);
+		if (!heightMap.empty() && !coarse.heightMap.empty())
+			heightMap[p] = heightScale * sampleBilinear(coarse.heightMap, coarse.width, coarse.height, x, y);
+		if (!sphereMap.empty() && !coarse.sphereMap.empty())
+			sphereMap[p] = sampleBilinear(coarse.sphereMap, coarse.width, coarse.height, x, y);
+
+		Eigen::Vector3d N = sampleBilinear(coarse.normalMap, coarse.width, coarse.height, x, y);
+		normalMap[p] = (N.norm() > 0.0) ? N.normalized() : geoNormalMap[p];
+	}
+
+	specularMap[0] = coarse.specularMap[0];
+	roughnessMap[0] = coarse.roughnessMap[0];
+}
+
+
+void AppearanceSolver::solveCoarseLevels()
+{
+	int coarseWidth = width / 2;
+	int coarseHeight = height / 2;
+
+	if (_MIN(coarseWidth, coarseHeight) < pyramidOpts.minResolution)
+	{
+		printf("Pyramid level %dx%d is below the minimum resolution, and is skipped.\n", coarseWidth, coarseHeight);
+		return;
+	}
+
+	AppearanceSolver coarse(coarseWidth, coarseHeight);
+	coarse.setNumThread(solverOptions.num_threads);
+	coarse.setFunctionTolerance(solverOptions.function_tolerance);
+	coarse.setOutputDirectory(pathInfo.outDir + "pyramid_" + std::to_string(coarseWidth) + "/");
+	coarse.setPyramidLevels(pyramidOpts.numLevels - 1, pyramidOpts.maxIterPerLevel);
+	coarse.pyramidOpts.minResolution = pyramidOpts.minResolution;
+	coarse.setCancellationToken(budgetOpts.cancelToken);
+	if (budgetOpts.timeBudget > 0.0)
+		coarse.setTimeBudget(budgetOpts.timeBudget - std::chrono::duration<double>(std::chrono::steady_clock::now() - runStart).count());
+
+	coarse.downsampleInputData(*this);
+	coarse.domain.set(domain.sx / 2, domain.sy / 2, (domain.ex - domain.sx + 1) / 2, (domain.ey - domain.sy + 1) / 2);
+	coarse.run(pyramidOpts.maxIterPerLevel);
+
+	printf("Upsampling the %dx%d solution to %dx%d...\n", coarseWidth, coarseHeight, width, height);
+	upsampleSolution(coarse);
+}
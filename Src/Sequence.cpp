@@ -0,0 +1,38 @@
+#include "pch.h"
+#include "AppearanceSolver.h"
+
+
+void AppearanceSolver::runSequence(const std::vector<std::string>& frameDirs, int maxIter, int warmIter)
+{
+	const std::string outDir = pathInfo.outDir;
+	bool bConverged = false;
+
+	for (int i = 0; i < (int)frameDirs.size(); ++i)
+	{
+		printf("Frame %d / %d : %s\n", i + 1, (int)frameDirs.size(), frameDirs[i].c_str());
+
+		if (i == 0)
+			setInputDirectory(frameDirs[i]);
+		else
+		{
+			setFrameDirectory(frameDirs[i]);
+			iterCount = -1;
+		}
+		setOutputDirectory(outDir + "frame" + std::to_string(i) + "/");
+
+		int numIter = bConverged ? warmIter : maxIter;
+		run(numIter);
+
+		// The callback is called once more than the iterations taken, so fewer calls mean an early stop.
+		// This holds for the joint schedule only, and the other schedules always get the full count.
+		bConverged = scheduleOpts.mode == SolveSchedule::joint && !constantProblem && runIterations <= numIter;
+
+		if (bStopRequested)
+		{
+			printf("The sequence is stopped at frame %d.\n", i + 1);
+			break;
+		}
+	}
+
+	setOutputDirectory(outDir);
+}
@@ -0,0 +1,127 @@
+#include "pch.h"
+#include "ShadowTable.h"
+#include "utils.h"
+
+
+void ShadowTable::clear()
+{
+	numWords = 0;
+	numTexels = 0;
+	origin = 0;
+	bCompressed = false;
+	bits.clear();
+	diffOffsets.clear();
+	diffWords.clear();
+	diffBits.clear();
+}
+
+
+std::vector<uint>& ShadowTable::edit(size_t numTexels, int numWords)
+{
+	clear();
+	this->numTexels = numTexels;
+	this->numWords = numWords;
+
+	auto& words = bits.edit();
+	words.assign(numTexels * numWords, 0u);
+	return words;
+}
+
+
+void ShadowTable::build(const std::vector<SharedMap<uint>>& planes, int numThreads)
+{
+	if (planes.empty())
+	{
+		clear();
+		return;
+	}
+
+	auto& words = edit(planes[0].size(), (int)planes.size());
+	origin = planes[0].first();
+
+	// Blocks of texels are transposed at a time, so that every plane is still read sequentially.
+	constexpr size_t kBlockSize = 4096;
+	int numBlocks = (int)((numTexels + kBlockSize - 1) / kBlockSize);
+	parallelFor(0, numBlocks, numThreads, [&](int b) {
+		size_t begin = b * kBlockSize;
+		size_t end = std::min(begin + kBlockSize, numTexels);
+		for (int i = 0; i < numWords; ++i)
+		{
+			const uint* plane = planes[i].data();
+			for (size_t p = begin; p < end; ++p)
+				words[p * numWords + i] = plane[p];
+		}
+	});
+}
+
+
+void ShadowTable::compress(int numThreads)
+{
+	if (bCompressed || empty())
+		return;
+	if (numWords > kMaxWords)
+	{
+		printf("[WARNING] Shadow tables of more than %d lights are not compressed.\n", kMaxWords * 32);
+		return;
+	}
+
+	const uint* words = bits.data();
+	int numGroups = (int)((numTexels + kGroupSize - 1) / kGroupSize);
+
+	auto differs = [&](size_t p, int i) {
+		return words[p * numWords + i] != words[(p / kGroupSize) * kGroupSize * numWords + i];
+	};
+
+	// The differences are counted first, so that every group can write its own range afterwards.
+	std::vector<uint> offsets(numTexels + 1, 0u);
+	parallelFor(0, numGroups, numThreads, [&](int g) {
+		size_t end = std::min((size_t)(g + 1) * kGroupSize, numTexels);
+		for (size_t p = (size_t)g * kGroupSize + 1; p < end; ++p)
+			for (int i = 0; i < numWords; ++i)
+				offsets[p + 1] += differs(p, i);
+	});
+	for (size_t p = 0; p < numTexels; ++p)
+		offsets[p + 1] += offsets[p];
+
+	std::vector<uint> keys((size_t)numGroups * numWords);
+	std::vector<uint16> indices(offsets[numTexels]);
+	std::vector<uint> xors(offsets[numTexels]);
+	parallelFor(0, numGroups, numThreads, [&](int g) {
+		size_t first = (size_t)g * kGroupSize;
+		size_t end = std::min(first + kGroupSize, numTexels);
+		memcpy(keys.data() + (size_t)g * numWords, words + first * numWords, numWords * sizeof(uint));
+
+		for (size_t p = first + 1; p < end; ++p)
+		{
+			uint d = offsets[p];
+			for (int i = 0; i < numWords; ++i)
+			{
+				if (!differs(p, i))
+					continue;
+				indices[d] = (uint16)i;
+				xors[d] = words[p * numWords + i] ^ words[first * numWords + i];
+				++d;
+			}
+		}
+	});
+
+	size_t before = numTexels * numWords * sizeof(uint);
+	size_t after = (keys.size() + offsets.size() + xors.size()) * sizeof(uint) + indices.size() * sizeof(uint16);
+	printf("Shadow table is compressed: %.1f MB -> %.1f MB\n", before / 1048576.0, after / 1048576.0);
+
+	bits.edit() = std::move(keys);
+	diffOffsets.edit() = std::move(offsets);
+	diffWords.edit() = std::move(indices);
+	diffBits.edit() = std::move(xors);
+	bCompressed = true;
+}
+
+
+std::vector<uint> ShadowTable::plane(int i) const
+{
+	std::vector<uint> words(numTexels);
+	uint scratch[kMaxWords];
+	for (size_t p = 0; p < numTexels; ++p)
+		words[p] = texel(origin + p, scratch)[i];
+	return words;
+}
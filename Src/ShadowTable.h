@@ -0,0 +1,63 @@
+#pragma once
+#include "pch.h"
+#include "SharedMap.h"
+
+
+// Visibility of the light samples from every texel, with the bits of a texel in consecutive words, so that the
+// light loop of a texel reads one block instead of one word of every shadow map.
+// The compressed table keeps the first texel of every kGroupSize texels of a row whole, and the other texels as
+// the words which differ from it, as neighbouring texels see nearly the same lights.
+class ShadowTable
+{
+	int numWords = 0;
+	size_t numTexels = 0;
+	size_t origin = 0;
+	bool bCompressed = false;
+
+	SharedMap<uint> bits;			// numWords per texel, or per group when compressed
+	SharedMap<uint> diffOffsets;	// the first difference of every texel, and the end of the last
+	SharedMap<uint16> diffWords;
+	SharedMap<uint> diffBits;
+
+public:
+	static constexpr int kGroupSize = 8;
+	static constexpr int kMaxWords = 64;
+
+	bool empty() const			{ return numTexels == 0; }
+	int words() const			{ return numWords; }
+	bool isCompressed() const	{ return bCompressed; }
+	bool contains(size_t p) const	{ return p >= origin && p - origin < numTexels; }
+
+	void clear();
+
+	// planes[i] holds the bits of lights 32i .. 32i+31 for every texel, as a shadow map file does.
+	// The table covers the texels of the planes, which share the same window.
+	void build(const std::vector<SharedMap<uint>>& planes, int numThreads);
+
+	// The uncompressed words of every texel, to be filled in by the caller.
+	std::vector<uint>& edit(size_t numTexels, int numWords);
+
+	// Tables of more than kMaxWords words stay uncompressed.
+	void compress(int numThreads);
+
+	// The words of texel p, decoded into scratch, of kMaxWords words, when the table is compressed.
+	const uint* texel(size_t p, uint* scratch) const {
+		p -= origin;
+		if (!bCompressed)
+			return bits.data() + p * numWords;
+
+		const uint* key = bits.data() + (p / kGroupSize) * numWords;
+		uint begin = diffOffsets[p];
+		uint end = diffOffsets[p + 1];
+		if (begin == end)
+			return key;
+
+		memcpy(scratch, key, numWords * sizeof(uint));
+		for (uint d = begin; d < end; ++d)
+			scratch[diffWords[d]] ^= diffBits[d];
+		return scratch;
+	}
+
+	// The words of one shadow map over the texels of the table.
+	std::vector<uint> plane(int i) const;
+};
@@ -0,0 +1,141 @@
+#pragma once
+#include "pch.h"
+
+
+// Texels are stored as they are in the capture files, and converted to the solver's types when read.
+inline Eigen::Vector3d fromTexel(const Eigen::Vector4f& texel)	{ return texel.head<3>().cast<double>(); }
+inline double fromTexel(float texel)								{ return texel; }
+inline Eigen::Vector4f toTexel(const Eigen::Vector3d& value)		{ return Eigen::Vector4f((float)value[0], (float)value[1], (float)value[2], 0.0f); }
+inline float toTexel(double value)								{ return (float)value; }
+
+
+template<typename T>
+inline T zeroTexel() {
+	if constexpr (std::is_arithmetic_v<T>)
+		return T(0);
+	else
+		return T::Zero();
+}
+
+
+// Half precision texel, padded to eight bytes so that texels stay aligned for vector loads.
+struct alignas(8) HalfTexel {
+	Eigen::half rgb[3];
+	Eigen::half pad;
+};
+
+inline Eigen::Vector3d fromTexel(const HalfTexel& texel)		{ return Eigen::Vector3d((float)texel.rgb[0], (float)texel.rgb[1], (float)texel.rgb[2]); }
+inline double fromTexel(Eigen::half texel)						{ return (float)texel; }
+inline HalfTexel toHalfTexel(const Eigen::Vector4f& texel)		{ return { { Eigen::half(texel[0]), Eigen::half(texel[1]), Eigen::half(texel[2]) }, Eigen::half(0.0f) }; }
+inline Eigen::half toHalfTexel(float texel)						{ return Eigen::half(texel); }
+
+
+// Input map whose storage is shared by all of its copies, e.g. by the solvers of a parameter sweep.
+// The storage is either owned or a read-only mapping of a file, and reads never copy it.
+// edit() detaches the map from the other copies, and from the file, before handing out the storage.
+// A map may hold only a window of the texels of an image, starting at first(), and is indexed as the whole image.
+template<typename T, typename Stored = T>
+class SharedMap
+{
+	std::shared_ptr<std::vector<Stored>> owned = std::make_shared<std::vector<Stored>>();
+	std::shared_ptr<const void> mapping;
+	const Stored* mapped = nullptr;
+	size_t mappedCount = 0;
+	size_t origin = 0;
+
+public:
+	const Stored* data() const	{ return mapping ? mapped : owned->data(); }
+	size_t size() const			{ return mapping ? mappedCount : owned->size(); }
+	bool empty() const			{ return size() == 0; }
+
+	size_t first() const				{ return origin; }
+	void setFirst(size_t first)			{ origin = first; }
+	bool contains(size_t i) const		{ return i >= origin && i - origin < size(); }
+
+	decltype(auto) operator[](size_t i) const {
+		if constexpr (std::is_same_v<T, Stored>)
+			return data()[i - origin];
+		else
+			return fromTexel(data()[i - origin]);
+	}
+
+	// Texels outside the window are zero.
+	std::vector<T> toVector(size_t fullSize) const {
+		std::vector<T> out(fullSize, zeroTexel<T>());
+		for (size_t i = origin; i < std::min(origin + size(), fullSize); ++i)
+			out[i] = (*this)[i];
+		return out;
+	}
+
+	// The owner keeps the mapping alive for as long as some copy of this map reads from it.
+	void map(std::shared_ptr<const void> owner, const Stored* base, size_t count, size_t first = 0) {
+		owned = std::make_shared<std::vector<Stored>>();
+		mapping = std::move(owner);
+		mapped = base;
+		mappedCount = count;
+		origin = first;
+	}
+
+	void clear() {
+		owned = std::make_shared<std::vector<Stored>>();
+		mapping.reset();
+		mapped = nullptr;
+		mappedCount = 0;
+		origin = 0;
+	}
+
+	std::vector<Stored>& edit() {
+		if (mapping)
+		{
+			owned = std::make_shared<std::vector<Stored>>(mapped, mapped + mappedCount);
+			mapping.reset();
+			mapped = nullptr;
+			mappedCount = 0;
+		}
+		else if (owned.use_count() > 1)
+			owned = std::make_shared<std::vector<Stored>>(*owned);
+		return *owned;
+	}
+};
+
+
+// Input map which is kept either as stored in the capture or in half precision, as chosen when it is loaded.
+template<typename T, typename Stored, typename Half>
+class PrecisionMap
+{
+	SharedMap<T, Stored> full;
+	SharedMap<T, Half> half;
+
+public:
+	T operator[](size_t i) const	{ return half.empty() ? full[i] : half[i]; }
+	size_t size() const				{ return half.empty() ? full.size() : half.size(); }
+	bool empty() const				{ return size() == 0; }
+	bool isHalf() const				{ return !half.empty(); }
+	size_t first() const			{ return half.empty() ? full.first() : half.first(); }
+	bool contains(size_t i) const	{ return half.empty() ? full.contains(i) : half.contains(i); }
+
+	// The texels in their current precision, e.g. to hash them.
+	const void* texelData() const	{ return half.empty() ? (const void*)full.data() : (const void*)half.data(); }
+	size_t texelSize() const		{ return half.empty() ? sizeof(Stored) : sizeof(Half); }
+
+	std::vector<T> toVector(size_t fullSize) const {
+		return half.empty() ? full.toVector(fullSize) : half.toVector(fullSize);
+	}
+
+	// The map in the precision of the capture, which drops the half precision copy.
+	SharedMap<T, Stored>& stored() {
+		half.clear();
+		return full;
+	}
+
+	void reducePrecision() {
+		if (full.empty())
+			return;
+		auto& texels = half.edit();
+		texels.resize(full.size());
+		for (size_t i = 0; i < texels.size(); ++i)
+			texels[i] = toHalfTexel(full.data()[i]);
+		half.setFirst(full.first());
+		full.clear();
+	}
+};
@@ -145,40 +145,38 @@ constexpr auto make_ones(std::index_sequence<j...>)
 
 
 template <typename D, size_t... k, size_t... j>
-void _addSmoothCost(ceres::Problem* problem, double* x_param, int dx, int dy, double weight, double exp, double base,  
-	std::index_sequence<k...>, std::index_sequence<j...>) 
+ceres::CostFunction* _makeSmoothCost(double* x_param, int dx, int dy, double weight, double exp, double base, 
+	std::vector<double*>& blockParams, std::index_sequence<k...>, std::index_sequence<j...>) 
 {
 	auto cost = [weight, exp, base] <typename... Params> (Params* ... params)
 	{
 		using T = typename _Head<Params...>::type;
 		T* x[] = { ((T*)(params))... };
 		T* residual = x[sizeof...(params) - 1];
-		( (residual[k] = weight * ceres::pow(D::residuals<k>(x) - base, exp)), ... );
+		( (residual[k] = weight * ceres::pow(D::template residuals<k>(x) - base, exp)), ... );
 		return true;
 	};
 	using F = decltype(cost);
 
-	problem->AddResidualBlock(
-		new ceres::AutoDiffCostFunction<F, D::maxResidual, j...>(new F(cost)),
-		nullptr, 
-		D::makeParams(x_param, dx, dy) );
+	blockParams = D::makeParams(x_param, dx, dy);
+	return new ceres::AutoDiffCostFunction<F, D::maxResidual, j...>(new F(cost));
 }
 
 
 template <SmoothType type>
-void _addSmoothCost(ceres::Problem* problem, double* x_param, int dx, int dy, double weight, double exp, double base=0.0)
+ceres::CostFunction* _makeSmoothCost(double* x_param, int dx, int dy, double weight, double exp, double base, std::vector<double*>& blockParams)
 {
-	_addSmoothCost< Desc<type> >(
-		problem, x_param, dx, dy, weight, exp, base,
+	return _makeSmoothCost< Desc<type> >(
+		x_param, dx, dy, weight, exp, base, blockParams,
 		std::make_index_sequence< Desc<type>::maxResidual >{},
 		make_ones(std::make_index_sequence< Desc<type>::numParams >{}) 
 	);
 }
 
 
-#define KV(key) {key, _addSmoothCost<key>}
-static std::unordered_map<SmoothType, void(*)(ceres::Problem*, double*, int, int, double, double, double)> 
-addSmoothCostFamily = {
+#define KV(key) {key, _makeSmoothCost<key>}
+static std::unordered_map<SmoothType, ceres::CostFunction*(*)(double*, int, int, double, double, double, std::vector<double*>&)> 
+makeSmoothCostFamily = {
 	KV(SmoothType::zero),
 	KV(SmoothType::one),
 	KV(SmoothType::two),
@@ -188,7 +186,15 @@ addSmoothCostFamily = {
 };
 
 
+ceres::CostFunction* makeSmoothCost(SmoothType type, double* x_param, int dx, int dy, double weight, double exp, double base, std::vector<double*>& blockParams)
+{
+	return makeSmoothCostFamily[type](x_param, dx, dy, weight, exp, base, blockParams);
+}
+
+
 void addSmoothCost(SmoothType type, ceres::Problem* problem, double* x_param, int dx, int dy, double weight, double exp, double base)
 {
-	addSmoothCostFamily[type](problem, x_param, dx, dy, weight, exp, base);
+	std::vector<double*> blockParams;
+	ceres::CostFunction* cost = makeSmoothCost(type, x_param, dx, dy, weight, exp, base, blockParams);
+	problem->AddResidualBlock(cost, nullptr, blockParams);
 }
\ No newline at end of file
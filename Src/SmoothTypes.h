@@ -34,4 +34,5 @@ inline bool useBase(SmoothType type)
 	return type == SmoothType::zero || type == SmoothType::five;
 }
 
+ceres::CostFunction* makeSmoothCost(SmoothType, double*, int, int, double, double, double, std::vector<double*>&);
 void addSmoothCost(SmoothType, ceres::Problem*, double*, int, int, double, double, double);
\ No newline at end of file
@@ -0,0 +1,112 @@
+#include "pch.h"
+#include "AppearanceSolver.h"
+#include "utils.h"
+#include <chrono>
+
+
+void AppearanceSolver::shareInputData(const AppearanceSolver& source)
+{
+	// The input maps are SharedMaps, so only their handles are copied here.
+	pathInfo = source.pathInfo;
+	lightSamples = source.lightSamples;
+	rigCameras = source.rigCameras;
+	positionMap = source.positionMap;
+	geoNormalMap = source.geoNormalMap;
+	shadowTable = source.shadowTable;
+	loadedWindow = source.loadedWindow;
+	tbnMap = source.tbnMap;
+	viewMasks = source.viewMasks;
+	viewMaskWords = source.viewMaskWords;
+	viewMaskKey = source.viewMaskKey;
+	disabledCameras = source.disabledCameras;
+
+	views.clear();
+	views.reserve(source.views.size());
+	for (const auto& sourceView : source.views)
+	{
+		ViewData view;
+		view.cameraId = sourceView.cameraId;
+		view.cameraPos = sourceView.cameraPos;
+		view.trgViewMap = sourceView.trgViewMap;
+		view.weightMap = sourceView.weightMap;
+		views.push_back(std::move(view));
+	}
+
+	problemOpts = source.problemOpts;
+	recordOpts = source.recordOpts;
+	pyramidOpts = source.pyramidOpts;
+	scheduleOpts = source.scheduleOpts;
+	constantOpts = source.constantOpts;
+	activeSetOpts = source.activeSetOpts;
+	budgetOpts = source.budgetOpts;
+	storageOpts = source.storageOpts;
+	cacheOpts = source.cacheOpts;
+	engine = source.engine;
+	bGridOrdering = source.bGridOrdering;
+	bHeightFromNormal = source.bHeightFromNormal;
+
+	solverOptions = source.solverOptions;
+	solverOptions.callbacks = { this };
+	solverOptions.linear_solver_ordering = nullptr;
+
+	diffuseMap = source.diffuseMap;
+	specularMap = source.specularMap;
+	roughnessMap = source.roughnessMap;
+	heightMap = source.heightMap;
+	normalMap = source.normalMap;
+	sphereMap = source.sphereMap;
+
+	domain.sx = source.domain.sx;
+	domain.sy = source.domain.sy;
+	domain.ex = source.domain.ex;
+	domain.ey = source.domain.ey;
+
+	iterCount = source.iterCount;
+	solverState = _MIN(source.solverState, invalidProblem);
+}
+
+
+void AppearanceSolver::runSweep(const std::vector<SweepConfig>& configs)
+{
+	if (!std::filesystem::exists(pathInfo.outDir))
+		std::filesystem::create_directories(pathInfo.outDir);
+
+	// Loading and the TBN frames are done once here, and every configuration starts from the same state.
+	if (!prepareInputs())
+		return;
+
+	struct SweepResult {
+		double finalCost = 0.0;
+		int iterations = 0;
+		double seconds = 0.0;
+	};
+	std::vector<SweepResult> results(configs.size());
+
+	const int numConfigs = (int)configs.size();
+	const int concurrency = _MAX(_MIN(numConfigs, solverOptions.num_threads), 1);
+	const int threadsPerConfig = _MAX(solverOptions.num_threads / concurrency, 1);
+
+	printf("Sweeping %d configurations, %d at a time with %d threads each.\n", numConfigs, concurrency, threadsPerConfig);
+
+	parallelFor(0, numConfigs, concurrency, [&](int i) {
+		auto start = std::chrono::steady_clock::now();
+
+		AppearanceSolver solver(width, height);
+		solver.shareInputData(*this);
+		solver.setNumThread(threadsPerConfig);
+		solver.setOutputDirectory(pathInfo.outDir + configs[i].name + "/");
+		if (configs[i].configure)
+			configs[i].configure(solver);
+		solver.run(configs[i].maxIter);
+
+		results[i].finalCost = solver.lastCost;
+		results[i].iterations = solver.runIterations - 1;
+		results[i].seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	});
+
+	FILE* fp = fopen((pathInfo.outDir + "sweep_summary.txt").c_str(), "w");
+	fprintf(fp, "%-24s  %-14s  %-10s  %s\n", "Configuration", "Final cost", "Iterations", "Seconds");
+	for (int i = 0; i < numConfigs; ++i)
+		fprintf(fp, "%-24s  %-14e  %-10d  %.1f\n", configs[i].name.c_str(), results[i].finalCost, results[i].iterations, results[i].seconds);
+	fclose(fp);
+}
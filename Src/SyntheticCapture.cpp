@@ -0,0 +1,487 @@
+#include "pch.h"
+#include "AppearanceSolver.h"
+#include "AccuracyCost.h"
+#include "utils.h"
+
+
+namespace {
+
+inline double square(double x) { return x * x; }
+
+inline double bump(double a, double e, double a0, double e0, double sa, double se)
+{
+	return std::exp(-square((a - a0) / sa) - square((e - e0) / se));
+}
+
+
+// A star-shaped head around 'center', with y up and the face towards +z as the rig sees it, in centimetres.
+// The texture space spans the azimuth and the elevation of the directions from the center.
+struct HeadModel
+{
+	static constexpr double maxAzimuth = 1.9;
+	static constexpr double topElevation = 1.0;
+	static constexpr double bottomElevation = -1.05;
+	static constexpr double maxRadius = 15.0;
+	static constexpr int tableWidth = 720;
+	static constexpr int tableHeight = 360;
+
+	Eigen::Vector3d center;
+	std::vector<double> table;
+
+	static Eigen::Vector3d direction(double a, double e) {
+		return { std::sin(a) * std::cos(e), std::sin(e), std::cos(a) * std::cos(e) };
+	}
+
+	static double radius(double a, double e) {
+		Eigen::Vector3d d = direction(a, e);
+		double r = 1.0 / std::sqrt(square(d[0] / 7.5) + square(d[1] / 11.0) + square(d[2] / 9.5));
+		double sa = std::abs(a);
+		r += 2.0 * bump(a, e, 0.0, -0.05, 0.13, 0.2);		// nose
+		r += 0.5 * bump(a, e, 0.0, 0.22, 0.6, 0.07);		// brow
+		r -= 0.8 * bump(sa, e, 0.38, 0.12, 0.14, 0.09);		// eye sockets
+		r += 0.4 * bump(sa, e, 0.55, -0.12, 0.2, 0.18);		// cheeks
+		r += 0.35 * bump(a, e, 0.0, -0.42, 0.3, 0.05);		// lips
+		r += 0.6 * bump(a, e, 0.0, -0.65, 0.3, 0.12);		// chin
+		return r;
+	}
+
+	Eigen::Vector3d position(double a, double e) const {
+		return center + radius(a, e) * direction(a, e);
+	}
+
+	HeadModel(const Eigen::Vector3d& center) : center(center), table((tableWidth + 1) * (tableHeight + 1)) {
+		for (int i = 0; i <= tableHeight; ++i)
+			for (int j = 0; j <= tableWidth; ++j)
+				table[i * (tableWidth + 1) + j] = radius(PI * (2.0 * j / tableWidth - 1.0), PI * (double(i) / tableHeight - 0.5));
+	}
+
+	// Radial distance from q to the surface, negative inside, from the bilinear table of radii.
+	double gap(const Eigen::Vector3d& q) const {
+		Eigen::Vector3d d = q - center;
+		double n = d.norm();
+		if (n >= maxRadius)
+			return n - maxRadius;
+
+		double x = (std::atan2(d[0], d[2]) / PI + 1.0) * 0.5 * tableWidth;
+		double y = (std::asin(std::clamp(d[1] / n, -1.0, 1.0)) / PI + 0.5) * tableHeight;
+		int j = _MIN((int)x, tableWidth - 1);
+		int i = _MIN((int)y, tableHeight - 1);
+		double fx = x - j;
+		double fy = y - i;
+		const double* row = &table[i * (tableWidth + 1) + j];
+		double r = (1 - fy) * ((1 - fx) * row[0] + fx * row[1]) + fy * ((1 - fx) * row[tableWidth + 1] + fx * row[tableWidth + 2]);
+		return n - r;
+	}
+
+	// Marches from the surface point P towards 'target' until the ray leaves the bounding sphere.
+	bool isOccluded(const Eigen::Vector3d& P, const Eigen::Vector3d& N, const Eigen::Vector3d& target) const {
+		Eigen::Vector3d origin = P + 0.02 * N;
+		Eigen::Vector3d dir = target - origin;
+		double length = dir.norm();
+		dir /= length;
+
+		double b = dir.dot(origin - center);
+		double c = (origin - center).squaredNorm() - maxRadius * maxRadius;
+		double exit = _MIN(-b + std::sqrt(_MAX(b * b - c, 0.0)), length);
+
+		for (double t = 0.05; t < exit; )
+		{
+			double g = gap(origin + t * dir);
+			if (g < 0.0)
+				return true;
+			t += _MAX(0.5 * g, 0.05);
+		}
+		return false;
+	}
+};
+
+
+struct LightPanel
+{
+	std::string name;
+	Eigen::Vector3d center;
+	Eigen::Vector3d normal;
+	Eigen::Vector3d axisU;
+	Eigen::Vector3d axisV;
+	Eigen::Vector3d emittance;
+	double extentU = 0.0;
+	double extentV = 0.0;
+	int numU = 1;
+	int numV = 1;
+};
+
+
+// The samples of a rect light are the centers of a row-major grid over it, named "<light>.<index>".
+std::vector<LightPanel> panelsOf(const json& samples)
+{
+	std::vector<std::string> names;
+	std::map<std::string, std::vector<const json*>> groups;
+	int index = 0;
+	for (const auto& sample : samples)
+	{
+		std::string name = sample.value("name", "RectLight" + std::to_string(++index));
+		name = name.substr(0, name.find_last_of('.'));
+		if (groups.find(name) == groups.end())
+			names.push_back(name);
+		groups[name].push_back(&sample);
+	}
+
+	auto vec = [](const json& value) {
+		return Eigen::Vector3d(value[0], value[1], value[2]);
+	};
+
+	std::vector<LightPanel> panels;
+	for (const auto& name : names)
+	{
+		const auto& group = groups[name];
+		LightPanel panel;
+		panel.name = name;
+		panel.normal = vec((*group[0])["normal"]).normalized();
+		panel.emittance = vec((*group[0])["emittance"]);
+		panel.center.setZero();
+		for (const json* sample : group)
+			panel.center += vec((*sample)["position"]) / (double)group.size();
+
+		Eigen::Vector3d first = vec((*group[0])["position"]);
+		Eigen::Vector3d helper = std::abs(panel.normal[1]) < 0.9 ? Eigen::Vector3d(0, 1, 0) : Eigen::Vector3d(1, 0, 0);
+		panel.axisU = group.size() > 1 ? vec((*group[1])["position"]) - first : helper.cross(panel.normal);
+		panel.axisU = (panel.axisU - panel.axisU.dot(panel.normal) * panel.normal).normalized();
+		panel.axisV = panel.normal.cross(panel.axisU);
+
+		auto countAlong = [&](const Eigen::Vector3d& axis, double& range) {
+			std::vector<double> offsets;
+			for (const json* sample : group)
+				offsets.push_back(axis.dot(vec((*sample)["position"]) - panel.center));
+			std::sort(offsets.begin(), offsets.end());
+			range = offsets.back() - offsets.front();
+			int count = 1;
+			for (size_t i = 1; i < offsets.size(); ++i)
+				count += offsets[i] - offsets[i - 1] > 1e-2;
+			return count;
+		};
+
+		double rangeU, rangeV;
+		panel.numU = countAlong(panel.axisU, rangeU);
+		panel.numV = countAlong(panel.axisV, rangeV);
+		if (panel.numU < (int)group.size() && panel.axisV.dot(vec((*group[panel.numU])["position"]) - first) < 0.0)
+			panel.axisV = -panel.axisV;
+
+		double area = (double)(*group[0])["area"] * group.size();
+		if (panel.numU > 1 && panel.numV > 1)
+		{
+			panel.extentU = rangeU * panel.numU / (panel.numU - 1);
+			panel.extentV = rangeV * panel.numV / (panel.numV - 1);
+		}
+		else if (panel.numU > 1)
+		{
+			panel.extentU = rangeU * panel.numU / (panel.numU - 1);
+			panel.extentV = area / panel.extentU;
+		}
+		else if (panel.numV > 1)
+		{
+			panel.extentV = rangeV * panel.numV / (panel.numV - 1);
+			panel.extentU = area / panel.extentV;
+		}
+		else
+			panel.extentU = panel.extentV = std::sqrt(area);
+
+		panels.push_back(panel);
+	}
+	return panels;
+}
+
+
+// Unreal coordinates are (-x, z, y) of the solver's, as loadRigData() reads them.
+Eigen::Vector3d fromUnreal(const json& p)	{ return { -(double)p[0], (double)p[2], (double)p[1] }; }
+json toUnreal(const Eigen::Vector3d& p)		{ return { -p[0], p[2], p[1] }; }
+
+
+// The point closest to the optical axes of the cameras, which all look at the head.
+Eigen::Vector3d rigTarget(const json& poses)
+{
+	Eigen::Matrix3d A = Eigen::Matrix3d::Zero();
+	Eigen::Vector3d b = Eigen::Vector3d::Zero();
+	Eigen::Vector3d mean = Eigen::Vector3d::Zero();
+	for (const auto& pose : poses)
+	{
+		Eigen::Vector3d origin = fromUnreal(pose["position"]);
+		mean += origin / (double)poses.size();
+		if (!pose.contains("rotation"))
+			continue;
+
+		double pitch = (double)pose["rotation"][1] * PI / 180.0;
+		double yaw = (double)pose["rotation"][2] * PI / 180.0;
+		Eigen::Vector3d dir = fromUnreal(json{ std::cos(pitch) * std::cos(yaw), std::cos(pitch) * std::sin(yaw), std::sin(pitch) });
+		Eigen::Matrix3d projector = Eigen::Matrix3d::Identity() - dir * dir.transpose();
+		A += projector;
+		b += projector * origin;
+	}
+
+	Eigen::FullPivLU<Eigen::Matrix3d> lu(A);
+	return lu.rank() == 3 ? Eigen::Vector3d(lu.solve(b)) : mean;
+}
+
+
+bool writeBinary(const std::string& fileName, const void* data, size_t bytes)
+{
+	FILE* fp = fopen(fileName.c_str(), "wb");
+	if (!fp)
+		return false;
+	bool ok = fwrite(data, 1, bytes, fp) == bytes;
+	return fclose(fp) == 0 && ok;
+}
+
+}
+
+
+bool AppearanceSolver::generateSyntheticCapture(const std::string& rigDir, const SyntheticCaptureConfig& config)
+{
+	std::string rigRoot = (rigDir.back() == '/' || rigDir.back() == '\\') ? rigDir : rigDir + '/';
+	std::string groundTruthDir = pathInfo.inDir + "GroundTruth/";
+	printf("Generating a synthetic capture in %s...\n", pathInfo.inDir.c_str());
+
+	json lightInfo, cameraInfo;
+	try
+	{
+		lightInfo = json::parse(std::ifstream(rigRoot + pathInfo.inLightSampleInfo));
+		cameraInfo = json::parse(std::ifstream(rigRoot + pathInfo.inCameraInfo));
+	}
+	catch (json::exception&)
+	{
+		printf("[WARNING] The rig cannot be read from %s\n", rigRoot.c_str());
+		return false;
+	}
+
+	const json& rigPoses = cameraInfo["Poses"];
+	if (rigPoses.empty() || lightInfo["Samples"].empty() || config.numCameras < 1 || config.numLightSamples < 1)
+		return false;
+
+	std::error_code error;
+	std::filesystem::create_directories(groundTruthDir, error);
+
+	// The rect lights are resampled on grids of their own aspect, so that the rig's count reproduces its samples.
+	std::vector<LightPanel> panels = panelsOf(lightInfo["Samples"]);
+	double rigSamples = (double)lightInfo["Samples"].size();
+
+	lightSamples.clear();
+	json samples = json::array();
+	for (const auto& panel : panels)
+	{
+		double scale = std::sqrt(config.numLightSamples / rigSamples);
+		int numU = _MAX((int)std::lround(panel.numU * scale), 1);
+		int numV = _MAX((int)std::lround(panel.numV * scale), 1);
+
+		for (int j = 0; j < numV; ++j)
+			for (int i = 0; i < numU; ++i)
+		{
+			LightSample l;
+			l.position = panel.center
+				+ ((i + 0.5) / numU - 0.5) * panel.extentU * panel.axisU
+				+ ((j + 0.5) / numV - 0.5) * panel.extentV * panel.axisV;
+			l.normal = panel.normal;
+			l.emittance = panel.emittance;
+			l.area = panel.extentU * panel.extentV / (numU * numV);
+			lightSamples.push_back(l);
+
+			samples.push_back({
+				{ "area", l.area },
+				{ "emittance", { l.emittance[0], l.emittance[1], l.emittance[2] } },
+				{ "name", panel.name + "." + std::to_string(j * numU + i + 1) },
+				{ "normal", { l.normal[0], l.normal[1], l.normal[2] } },
+				{ "position", { l.position[0], l.position[1], l.position[2] } } });
+		}
+	}
+
+	// Fewer cameras are picked evenly from the rig, and more are added halfway between consecutive ones.
+	HeadModel head(rigTarget(rigPoses));
+	std::vector<Eigen::Vector3d> cameras;
+	int numRig = (int)rigPoses.size();
+	for (int c = 0; c < _MIN(config.numCameras, numRig); ++c)
+		cameras.push_back(fromUnreal(rigPoses[(size_t)c * numRig / _MIN(config.numCameras, numRig)]["position"]));
+	for (int c = 0; (int)cameras.size() < config.numCameras; ++c)
+	{
+		Eigen::Vector3d a = cameras[c] - head.center;
+		Eigen::Vector3d b = cameras[(c + 1) % cameras.size()] - head.center;
+		cameras.push_back(head.center + (a.normalized() + b.normalized()).normalized() * 0.5 * (a.norm() + b.norm()));
+	}
+
+	json poses = json::array();
+	views.clear();
+	for (int c = 0; c < config.numCameras; ++c)
+	{
+		json look = toUnreal(head.center - cameras[c]);
+		double pitch = std::atan2((double)look[2], std::hypot((double)look[0], (double)look[1])) * 180.0 / PI;
+		double yaw = std::atan2((double)look[1], (double)look[0]) * 180.0 / PI;
+		poses.push_back({ { "id", c + 1 }, { "position", toUnreal(cameras[c]) }, { "rotation", { 90.0, pitch, yaw } } });
+
+		ViewData view;
+		view.cameraId = c + 1;
+		view.cameraPos = cameras[c];
+		views.push_back(std::move(view));
+	}
+	cameraInfo["Poses"] = poses;
+	cameraInfo["Coordinates"] = "Unreal";
+
+	bool ok = true;
+	auto writeText = [&](const std::string& fileName, const std::string& text) {
+		std::ofstream file(pathInfo.inDir + fileName);
+		if (file << text && file.flush())
+			return;
+		printf("[WARNING] Failed to write the file: %s\n", fileName.c_str());
+		ok = false;
+	};
+	writeText(pathInfo.inLightSampleInfo, json{ { "Samples", samples } }.dump(2));
+	writeText(pathInfo.inCameraInfo, cameraInfo.dump(1, '\t'));
+
+	// Geometry and ground truth, with the corners of the texture space left empty as around a UV island.
+	const size_t numTexels = (size_t)width * height;
+	positionMap.clear();
+	geoNormalMap.clear();
+	auto& positions = positionMap.edit();
+	auto& normals = geoNormalMap.edit();
+	positions.assign(numTexels, Eigen::Vector4f::Zero());
+	normals.assign(numTexels, Eigen::Vector4f::Zero());
+
+	std::vector<Eigen::Vector3d> trueDiffuse(numTexels, Eigen::Vector3d::Zero());
+	std::vector<double> trueSpecular(numTexels, defaultSpecular);
+	std::vector<double> trueRoughness(numTexels, defaultRoughness);
+	std::vector<Eigen::Vector3d> trueNormal(numTexels, Eigen::Vector3d::Zero());
+	std::vector<uint8> inside(numTexels, 0);
+
+	parallelFor(0, height, solverOptions.num_threads, [&](int y) {
+		for (int x = 0; x < width; ++x)
+		{
+			double u = 2.0 * (x + 0.5) / width - 1.0;
+			double v = 2.0 * (y + 0.5) / height - 1.0;
+			if (square(u * u) + square(v * v) > 1.0)
+				continue;
+
+			int p = y * width + x;
+			double a = u * HeadModel::maxAzimuth;
+			double e = HeadModel::topElevation + 0.5 * (v + 1.0) * (HeadModel::bottomElevation - HeadModel::topElevation);
+
+			const double h = 1e-4;
+			Eigen::Vector3d P = head.position(a, e);
+			Eigen::Vector3d Pa = head.position(a + h, e) - head.position(a - h, e);
+			Eigen::Vector3d Pe = head.position(a, e + h) - head.position(a, e - h);
+			Eigen::Vector3d N = Pa.cross(Pe).normalized();
+			if (N.dot(P - head.center) < 0.0)
+				N = -N;
+
+			Eigen::Vector3d T = (Pa - Pa.dot(N) * N).normalized();
+			Eigen::Vector3d B = N.cross(T);
+			double sa = std::abs(a);
+			double tZone = bump(a, e, 0.0, -0.05, 0.15, 0.25) + bump(a, e, 0.0, 0.5, 0.5, 0.25);
+			double cheeks = bump(sa, e, 0.55, -0.12, 0.25, 0.2);
+			double lips = bump(a, e, 0.0, -0.42, 0.3, 0.05);
+			double tone = 1.0 + 0.08 * std::sin(7.0 * a + 3.0 * e) * std::cos(5.0 * e);
+
+			inside[p] = 1;
+			positions[p] = toTexel(P);
+			normals[p] = toTexel(N);
+			trueDiffuse[p] = (tone * Eigen::Vector3d(0.62, 0.42, 0.33) + cheeks * Eigen::Vector3d(0.06, -0.03, -0.02)
+				+ lips * Eigen::Vector3d(-0.02, -0.12, -0.06)).cwiseMax(0.0).cwiseMin(1.0);
+			trueSpecular[p] = 1.0 + 0.35 * tZone - 0.3 * cheeks - 0.3 * lips;
+			trueRoughness[p] = 0.25 - 0.07 * tZone + 0.05 * cheeks;
+			trueNormal[p] = (N
+				+ 0.06 * std::sin(61.0 * a + 2.0 * std::sin(37.0 * e)) * T
+				+ 0.06 * std::sin(53.0 * e + 2.0 * std::sin(41.0 * a)) * B).normalized();
+		}
+	});
+
+	auto writeMap = [&](const std::string& fileName, const auto& texels) {
+		if (writeBinary(pathInfo.inDir + fileName, texels.data(), texels.size() * sizeof(texels[0])))
+			return;
+		printf("[WARNING] Failed to write the map: %s\n", fileName.c_str());
+		ok = false;
+	};
+	auto writeTruth = [&](const std::string& name, const double* src, int channels) {
+		if (writeFloatImage(groundTruthDir + name + ".pfm", src, width, height, channels))
+			return;
+		printf("[WARNING] Failed to write the ground truth: %s.pfm\n", name.c_str());
+		ok = false;
+	};
+	auto numbered = [](std::string pattern, int index) {
+		pattern.replace(pattern.find_last_of('$'), 1, std::to_string(index));
+		return pattern;
+	};
+
+	writeMap(pathInfo.inPositionMap, positions);
+	writeMap(pathInfo.inNormalMap, normals);
+	writeTruth(pathInfo.outDiffuseMap, (double*)trueDiffuse.data(), 3);
+	writeTruth(pathInfo.outSpecularMap, trueSpecular.data(), 1);
+	writeTruth(pathInfo.outRoughnessMap, trueRoughness.data(), 1);
+	writeTruth(pathInfo.outNormalMap, (double*)trueNormal.data(), 3);
+
+	// A light is visible where it is in front of the geometry and no part of the head is in between.
+	const int numWords = (int)(lightSamples.size() + shadowPackSize - 1) / shadowPackSize;
+	bUseShadow = config.bShadows;
+	if (config.bShadows)
+	{
+		printf("Shadow computation for %d light samples...\n", (int)lightSamples.size());
+		auto& words = shadowTable.edit(numTexels, numWords);
+		parallelFor(0, height, solverOptions.num_threads, [&](int y) {
+			for (int p = y * width; p < (y + 1) * width; ++p)
+			{
+				if (!inside[p])
+					continue;
+				Eigen::Vector3d P = positionMap[p];
+				Eigen::Vector3d N = geoNormalMap[p];
+				for (int i = 0; i < (int)lightSamples.size(); ++i)
+				{
+					const LightSample& l = lightSamples[i];
+					if (N.dot(l.position - P) <= 0.0 || l.normal.dot(P - l.position) <= 0.0 || head.isOccluded(P, N, l.position))
+						continue;
+					words[(size_t)p * numWords + i / shadowPackSize] |= 1u << (i % shadowPackSize);
+				}
+			}
+		});
+
+		for (int i = 0; i < numWords; ++i)
+			writeMap(numbered(pathInfo.inShadowMaps, i + 1), shadowTable.plane(i));
+	}
+
+	// The views are rendered from the ground truth, and texels the camera cannot see are left zero as uncaptured.
+	std::vector<Eigen::Vector4f> radiance(numTexels);
+	std::vector<float> weights(numTexels);
+	for (int v = 0; v < (int)views.size(); ++v)
+	{
+		printf("Rendering the view of camera %d...\n", views[v].cameraId);
+		parallelFor(0, height, solverOptions.num_threads, [&](int y) {
+			for (int p = y * width; p < (y + 1) * width; ++p)
+			{
+				radiance[p] = Eigen::Vector4f::Zero();
+				weights[p] = 0.0f;
+				if (!inside[p])
+					continue;
+
+				Eigen::Vector3d P = positionMap[p];
+				Eigen::Vector3d N = geoNormalMap[p];
+				double cosView = N.dot((views[v].cameraPos - P).normalized());
+				if (cosView <= 0.0 || head.isOccluded(P, N, views[v].cameraPos))
+					continue;
+
+				Eigen::Vector3d color = evaluate<double>(v, p, trueDiffuse[p], trueSpecular[p], trueRoughness[p], trueNormal[p]);
+				radiance[p] = toTexel(color.cwiseMax(1e-6));
+				weights[p] = (float)cosView;
+			}
+		});
+
+		writeMap(numbered(pathInfo.inViewMaps, views[v].cameraId), radiance);
+		writeMap(numbered(pathInfo.inWeightMaps, views[v].cameraId), weights);
+	}
+
+	// The rendering state is dropped, and the next run() loads the capture from the files.
+	lightSamples.clear();
+	positionMap.clear();
+	geoNormalMap.clear();
+	views.clear();
+	viewMasks.clear();
+	shadowTable.clear();
+	bUseShadow = false;
+	changeState(invalidInputData);
+
+	printf("The synthetic capture has %d cameras and %d light samples, and its ground truth is in %s\n",
+		config.numCameras, (int)samples.size(), groundTruthDir.c_str());
+	return ok;
+}
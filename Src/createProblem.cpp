@@ -31,7 +31,7 @@ constexpr auto operator,(std::index_sequence<ints1...>, std::index_sequence<ints
 template <typename... Params>
 constexpr auto enumerate()
 {
-	return (..., Params::seq());
+	return (..., typename Params::seq());
 }
 
 template <typename CostFtn, size_t... ints>
@@ -171,153 +171,203 @@ inline ceres::CostFunction* makeAutoDiffCostFunction(
 
 void AppearanceSolver::createProblem()
 {
+	TRACE_SCOPE("createProblem");
 	if (problem)
 		delete problem;
+	problem = nullptr;
 
-	problem = new ceres::Problem;
-	const auto& opt = problemOpts;
-	
-	int count = 0;
+	for (auto& [params, blockProblem] : blockProblems)
+		delete blockProblem;
+	blockProblems.clear();
 
-	for (int p : domain)
-	{
-		double* const x_diff = diffuseMap[p].data();
-		double* const x_spec = !opt.constantSpecular ? &specularMap[p] : &specularMap[0];
-		double* const x_r = !opt.constantRoughness ? &roughnessMap[p] : &roughnessMap[0];
-		double* const x_h = &heightMap[p];
-		double* const x_sh = sphereMap[p].data();
-		double* const x_nor = normalMap[p].data();
+	if (constantProblem)
+		delete constantProblem;
+	constantProblem = nullptr;
 
-		std::vector<double*> mutable_parameters;
-		mutable_parameters.reserve(maxParams);
+	// In the two-level solve the constants get their own small problem, which keeps them out of the per-pixel one.
+	if (constantOpts.bTwoLevel && constantParams())
+		constantProblem = createConstantProblem();
 
-		if (opt.params & ParamSpace::param_diffuse)
+	auto build = [this](ParamSpace params) -> ceres::Problem* {
+		SolverEngine resolved = resolveEngine(params);
+		if (engine != SolverEngine::automatic && engine != resolved)
+			printf("[WARNING] The requested engine cannot solve parameter block 0x%x, and ceres is used instead.\n", (int)params);
+		return (resolved == SolverEngine::ceres) ? createProblem(params) : nullptr;
+	};
+
+	// A null problem marks a parameter block that is solved by one of our own engines in solveBlock().
+	if (scheduleOpts.mode == SolveSchedule::alternating)
+	{
+		// Diffuse is nearly linear once the rest is fixed, specular and roughness stay per pixel,
+		// and only the normal block couples neighbouring pixels through the height stencils.
+		for (ParamSpace group : { param_diffuse, param_specular | param_roughness, param_normal })
 		{
-			mutable_parameters.push_back(x_diff + 0);
-			mutable_parameters.push_back(x_diff + 1);
-			mutable_parameters.push_back(x_diff + 2);
+			if (ParamSpace params = pixelParams() & group; params)
+				blockProblems.emplace_back(params, build(params));
 		}
+	}
+	else if (pixelParams())
+	{
+		problem = build(pixelParams());
+	}
+}
+
 
-		if (opt.params & ParamSpace::param_specular)
+bool AppearanceSolver::visitResidualBlocks(int p, ParamSpace params, const ResidualVisitor& visit)
+{
+	const auto& opt = problemOpts;
+
+	double* const x_diff = diffuseMap[p].data();
+	double* const x_spec = !opt.constantSpecular ? &specularMap[p] : &specularMap[0];
+	double* const x_r = !opt.constantRoughness ? &roughnessMap[p] : &roughnessMap[0];
+	double* const x_h = !heightMap.empty() ? &heightMap[p] : nullptr;
+	double* const x_sh = !sphereMap.empty() ? sphereMap[p].data() : nullptr;
+	double* const x_nor = normalMap[p].data();
+
+	std::vector<double*> mutable_parameters;
+	mutable_parameters.reserve(maxParams);
+
+	if (params & ParamSpace::param_diffuse)
+	{
+		mutable_parameters.push_back(x_diff + 0);
+		mutable_parameters.push_back(x_diff + 1);
+		mutable_parameters.push_back(x_diff + 2);
+	}
+
+	if (params & ParamSpace::param_specular)
+	{
+		mutable_parameters.push_back(x_spec);
+	}
+
+	if (params & ParamSpace::param_roughness)
+	{
+		mutable_parameters.push_back(x_r);
+	}
+
+	if (params & ParamSpace::param_normal)
+	{
+		if (opt.normalMode == NormalOptMode::raw_normal)
 		{
-			mutable_parameters.push_back(x_spec);
+			mutable_parameters.push_back(x_nor);
 		}
-
-		if (opt.params & ParamSpace::param_roughness)
+		else if (opt.normalMode == NormalOptMode::raw_normal2D)
 		{
-			mutable_parameters.push_back(x_r);
+			mutable_parameters.push_back(x_sh + 0);
+			mutable_parameters.push_back(x_sh + 1);
 		}
-
-		if (opt.params & ParamSpace::param_normal)
+		else
 		{
-			if (opt.normalMode == NormalOptMode::raw_normal)
-			{
-				mutable_parameters.push_back(x_nor);
-			}
-			else if (opt.normalMode == NormalOptMode::raw_normal2D)
+			if (opt.diffMode == DifferenceMode::forward)
 			{
-				mutable_parameters.push_back(x_sh + 0);
-				mutable_parameters.push_back(x_sh + 1);
+				mutable_parameters.push_back(x_h);
+				mutable_parameters.push_back(x_h - dx);
+				mutable_parameters.push_back(x_h - dy);
 			}
-			else
+			else if (opt.diffMode == DifferenceMode::forward2)
 			{
-				if (opt.diffMode == DifferenceMode::forward)
-				{
-					mutable_parameters.push_back(x_h);
-					mutable_parameters.push_back(x_h - dx);
-					mutable_parameters.push_back(x_h - dy);
-				}
-				else if (opt.diffMode == DifferenceMode::forward2)
-				{
-					mutable_parameters.push_back(x_h);
-					mutable_parameters.push_back(x_h + dx);
-					mutable_parameters.push_back(x_h + dy);
-				}									 
-				else								 
-				{									 
-					mutable_parameters.push_back(x_h - dx);
-					mutable_parameters.push_back(x_h + dx);
-					mutable_parameters.push_back(x_h - dy);
-					mutable_parameters.push_back(x_h + dy);
-				}
+				mutable_parameters.push_back(x_h);
+				mutable_parameters.push_back(x_h + dx);
+				mutable_parameters.push_back(x_h + dy);
+			}									 
+			else								 
+			{									 
+				mutable_parameters.push_back(x_h - dx);
+				mutable_parameters.push_back(x_h + dx);
+				mutable_parameters.push_back(x_h - dy);
+				mutable_parameters.push_back(x_h + dy);
 			}
 		}
+	}
 
-		double total_weight = 0.0;
-		std::vector<double> frameWeights(views.size(), 0.0);
-		
-		for (int v = 0; v < views.size(); v++)
-		{
-			if (isEnabled(views[v].cameraId) && 
-				isValidPixel(views[v].trgViewMap, p) &&
-				views[v].weightMap[p] > opt.viewWeightMin)
-			{
-				frameWeights[v] = ceres::pow(views[v].weightMap[p], opt.viewWeightBias);
-				total_weight += frameWeights[v];
-			}
-		}
+	std::vector<double> frameWeights;
+	double total_weight = computeViewWeights(p, frameWeights);
 
-		if (total_weight == 0.0)
-			continue;
+	if (total_weight == 0.0)
+		return false;
 
-		for (int v = 0; v < views.size(); v++)
+	for (int v = 0; v < views.size(); v++)
+	{
+		if (frameWeights[v] > 0.0)
 		{
-			if (frameWeights[v] > 0.0)
-			{
-				ceres::CostFunction* cost_function = makeAutoDiffCostFunction(
-					new AccuracyCost(*this, v, p, ceres::sqrt(frameWeights[v] / total_weight)),
-					opt.params,
-					opt.normalMode,
-					opt.diffMode);
+			ceres::CostFunction* cost_function = makeAutoDiffCostFunction(
+				new AccuracyCost(*this, v, p, ceres::sqrt(frameWeights[v] / total_weight), params),
+				params,
+				opt.normalMode,
+				opt.diffMode);
 
-				problem->AddResidualBlock(cost_function, nullptr, mutable_parameters);
-			}
+			visit(cost_function, mutable_parameters);
 		}
+	}
 
-		for (auto& [param_type, weight_exp] : opt.smoothWeightAndExp)
+	for (auto& [param_type, weight_exp] : opt.smoothWeightAndExp)
+	{
+		auto& [param, smoothType] = param_type;
+		auto& [weight, exp] = weight_exp;
+		if(weight <= 0.0) continue;
+		
+		double* x_param = nullptr;
+		int dx = this->dx;
+		int dy = this->dy;
+		switch (param) 
 		{
-			auto& [param, smoothType] = param_type;
-			auto& [weight, exp] = weight_exp;
-			if(weight <= 0.0) continue;
-			
-			double* x_param = nullptr;
-			int dx = this->dx;
-			int dy = this->dy;
-			switch (param) 
-			{
-			case Param::diffuseR:	
-				if(!(opt.params & ParamSpace::param_diffuse)) continue;
-				x_param = x_diff + 0; dx*=3; dy*=3;	
-				break;
-			case Param::diffuseG:
-				if(!(opt.params & ParamSpace::param_diffuse)) continue;
-				x_param = x_diff + 1; dx*=3; dy*=3;	
-				break;
-			case Param::diffuseB:	
-				if(!(opt.params & ParamSpace::param_diffuse)) continue;
-				x_param = x_diff + 2; dx*=3; dy*=3;	
-				break;
-			case Param::specular:	
-				if(!(opt.params & ParamSpace::param_specular) || opt.constantSpecular) continue;
-				x_param = x_spec;					
-				break;
-			case Param::roughness:	
-				if(!(opt.params & ParamSpace::param_roughness) || opt.constantRoughness) continue;
-				x_param = x_r;						
-				break;
-			case Param::height:		
-				if(!(opt.params & ParamSpace::param_normal) || opt.normalMode==NormalOptMode::raw_normal || opt.normalMode==NormalOptMode::raw_normal2D) continue;
-				x_param = x_h;						
-				break;
-			case Param::sphere:		
-				if(!(opt.params & ParamSpace::param_normal) || opt.normalMode!=NormalOptMode::raw_normal2D) continue;
-				x_param = x_sh;		  dx*=2; dy*=2;	
-				break;
-			}
-
-			addSmoothCost(smoothType, problem, x_param, dx, dy, weight, exp, useBase(smoothType) ? opt.base[(int)param] : 0.0);
+		case Param::diffuseR:	
+			if(!(params & ParamSpace::param_diffuse)) continue;
+			x_param = x_diff + 0; dx*=3; dy*=3;	
+			break;
+		case Param::diffuseG:
+			if(!(params & ParamSpace::param_diffuse)) continue;
+			x_param = x_diff + 1; dx*=3; dy*=3;	
+			break;
+		case Param::diffuseB:	
+			if(!(params & ParamSpace::param_diffuse)) continue;
+			x_param = x_diff + 2; dx*=3; dy*=3;	
+			break;
+		case Param::specular:	
+			if(!(params & ParamSpace::param_specular) || opt.constantSpecular) continue;
+			x_param = x_spec;					
+			break;
+		case Param::roughness:	
+			if(!(params & ParamSpace::param_roughness) || opt.constantRoughness) continue;
+			x_param = x_r;						
+			break;
+		case Param::height:		
+			if(!(params & ParamSpace::param_normal) || opt.normalMode==NormalOptMode::raw_normal || opt.normalMode==NormalOptMode::raw_normal2D) continue;
+			x_param = x_h;						
+			break;
+		case Param::sphere:		
+			if(!(params & ParamSpace::param_normal) || opt.normalMode!=NormalOptMode::raw_normal2D) continue;
+			x_param = x_sh;		  dx*=2; dy*=2;	
+			break;
 		}
 
+		std::vector<double*> smoothParams;
+		visit(makeSmoothCost(smoothType, x_param, dx, dy, weight, exp, useBase(smoothType) ? opt.base[(int)param] : 0.0, smoothParams), smoothParams);
+	}
+
+	return true;
+}
+
+
+ceres::Problem* AppearanceSolver::createProblem(ParamSpace params)
+{
+	ceres::Problem* problem = newProblem();
+	const auto& opt = problemOpts;
+	
+	int count = 0;
+
+	for (int p : domain)
+	{
+		if (!visitResidualBlocks(p, params, [problem](ceres::CostFunction* cost, const std::vector<double*>& blockParams) {
+				problem->AddResidualBlock(cost, nullptr, blockParams);
+			}))
+			continue;
+
+		double* const x_diff = diffuseMap[p].data();
+		double* const x_spec = !opt.constantSpecular ? &specularMap[p] : &specularMap[0];
+		double* const x_r = !opt.constantRoughness ? &roughnessMap[p] : &roughnessMap[0];
+		double* const x_h = !heightMap.empty() ? &heightMap[p] : nullptr;
+		double* const x_sh = !sphereMap.empty() ? sphereMap[p].data() : nullptr;
+
 		for (auto& [param, bound] : opt.bounds)
 		{
 			auto& [lb, ub] = bound;
@@ -325,31 +375,31 @@ void AppearanceSolver::createProblem()
 			switch (param) 
 			{
 			case Param::diffuseR:	
-				if(!(opt.params & ParamSpace::param_diffuse)) continue;
+				if(!(params & ParamSpace::param_diffuse)) continue;
 				x_param = x_diff + 0; 	
 				break;
 			case Param::diffuseG:	
-				if(!(opt.params & ParamSpace::param_diffuse)) continue;
+				if(!(params & ParamSpace::param_diffuse)) continue;
 				x_param = x_diff + 1; 	
 				break;
 			case Param::diffuseB:	
-				if(!(opt.params & ParamSpace::param_diffuse)) continue;
+				if(!(params & ParamSpace::param_diffuse)) continue;
 				x_param = x_diff + 2; 	
 				break;
 			case Param::specular:	
-				if(!(opt.params & ParamSpace::param_specular)) continue;
+				if(!(params & ParamSpace::param_specular)) continue;
 				x_param = x_spec;		
 				break;
 			case Param::roughness:	
-				if(!(opt.params & ParamSpace::param_roughness)) continue;
+				if(!(params & ParamSpace::param_roughness)) continue;
 				x_param = x_r;			
 				break;
 			case Param::height:		
-				if(!(opt.params & ParamSpace::param_normal)|| opt.normalMode==NormalOptMode::raw_normal || opt.normalMode==NormalOptMode::raw_normal2D) continue;
+				if(!(params & ParamSpace::param_normal)|| opt.normalMode==NormalOptMode::raw_normal || opt.normalMode==NormalOptMode::raw_normal2D) continue;
 				x_param = x_h;			
 				break;
 			case Param::sphere:		
-				if(!(opt.params & ParamSpace::param_normal) || opt.normalMode!=NormalOptMode::raw_normal2D) continue;
+				if(!(params & ParamSpace::param_normal) || opt.normalMode!=NormalOptMode::raw_normal2D) continue;
 				x_param = x_sh;			
 				break;
 			}
@@ -364,6 +414,7 @@ void AppearanceSolver::createProblem()
 	}
 
 	printf("\n");
+	return problem;
 }
 
 
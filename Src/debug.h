@@ -6,6 +6,110 @@
 #else
 #define debug(x) ((void)0)
 #endif
-#endif
 
 
+// Scoped timers, recorded per thread and written by TRACE_WRITE(path) in the Chrome trace format,
+// which chrome://tracing and ui.perfetto.dev open. They are compiled out unless TRACE is defined.
+#ifdef TRACE
+#include <mutex>
+#include <memory>
+
+namespace trace {
+
+struct Event {
+	const char* name;
+	double begin;		// microseconds since the process started
+	double duration;
+};
+
+// Events are appended by their own thread, and the lock is only contended while the trace is written.
+struct ThreadBuffer {
+	std::mutex mutex;
+	std::vector<Event> events;
+	std::string name;
+	int id = 0;
+};
+
+inline const std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+inline std::mutex registryMutex;
+inline std::vector<std::shared_ptr<ThreadBuffer>> registry;
+
+inline double now() {
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+}
+
+// Buffers outlive their threads, so that the events of finished threads are written as well.
+inline ThreadBuffer& local() {
+	thread_local std::shared_ptr<ThreadBuffer> buffer = []() {
+		auto created = std::make_shared<ThreadBuffer>();
+		std::lock_guard<std::mutex> lock(registryMutex);
+		created->id = (int)registry.size() + 1;
+		registry.push_back(created);
+		return created;
+	}();
+	return *buffer;
+}
+
+inline void record(const char* name, double begin, double end) {
+	ThreadBuffer& buffer = local();
+	std::lock_guard<std::mutex> lock(buffer.mutex);
+	buffer.events.push_back({ name, begin, end - begin });
+}
+
+inline void nameThread(const char* name) {
+	ThreadBuffer& buffer = local();
+	std::lock_guard<std::mutex> lock(buffer.mutex);
+	buffer.name = name;
+}
+
+class Scope {
+	const char* name;
+	double begin;
+public:
+	explicit Scope(const char* name) : name(name), begin(now()) {}
+	~Scope() { record(name, begin, now()); }
+};
+
+// Every event since the process started is written, and the trace of a later run replaces the file.
+inline void write(const std::string& path) {
+	FILE* fp = fopen(path.c_str(), "w");
+	if (!fp)
+		return;
+
+	std::lock_guard<std::mutex> registryLock(registryMutex);
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool bFirst = true;
+	for (const auto& buffer : registry)
+	{
+		std::lock_guard<std::mutex> lock(buffer->mutex);
+		if (!buffer->name.empty())
+		{
+			fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				bFirst ? "" : ",\n", buffer->id, buffer->name.c_str());
+			bFirst = false;
+		}
+		for (const Event& event : buffer->events)
+		{
+			fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				bFirst ? "" : ",\n", event.name, buffer->id, event.begin, event.duration);
+			bFirst = false;
+		}
+	}
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+}
+
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) trace::Scope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_THREAD(name) trace::nameThread(name)
+#define TRACE_WRITE(path) trace::write(path)
+#else
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_THREAD(name) ((void)0)
+#define TRACE_WRITE(path) ((void)0)
+#endif
+
+#endif
@@ -14,7 +14,20 @@ int main()
 		solver.setNumThread(4);
 
 		solver.setInputDirectory("Data/example/");
+		//solver.setInputDirectory("Data/synthetic/");
+		//solver.generateSyntheticCapture("Data/example/", { 12, 750, true });
+		//solver.exportCapture("Data/example/capture.fbc");
+		//solver.setCacheDirectory("Data/Cache/");
+		//solver.setHalfPrecisionViews(true);
+		//solver.setCompressedShadows(true);
+		//solver.setRecording(4, record_diffuse | record_normal);
+		//solver.setFloatOutput(true);
 		solver.setDomain(0, 0, 1024, 1024);
+		//solver.setCroppedInput(true);
+		//solver.setPyramidLevels(3, 10);
+		//solver.setCheckpointInterval(4);
+		//solver.setTimeBudget(4 * 3600.0);
+		//solver.resumeFrom("Data/example/Output/2/checkpoint.bin");
 		
 		solver.setViewWeightMin(0.001);
 		solver.setViewWeightBias(8.0);
@@ -22,6 +35,7 @@ int main()
 
 		solver.setNormalMode(NormalOptMode::heightmap2018);
 		solver.setDifferenceMode(DifferenceMode::forward2);
+		//solver.setHeightFromNormal(true);
 
 		solver.setParamSpace(
 			ParamSpace::param_diffuse
@@ -40,10 +54,16 @@ int main()
 		solver.setSmoothCost(Param::height, SmoothType::one, 0.1);
 
 		solver.setConstantSpecular(true);
+		//solver.setTwoLevelConstants(true, 3, 8);
 
 		solver.setOutputDirectory("Data/example/Output/2/");
 		solver.run(31);
 
+		//solver.runSweep({
+		//	{ "roughness_0.01", [](AppearanceSolver& s) { s.setSmoothCost(Param::roughness, SmoothType::one, 0.01); }, 31 },
+		//	{ "roughness_0.1",  [](AppearanceSolver& s) { s.setSmoothCost(Param::roughness, SmoothType::one, 0.1); }, 31 },
+		//});
+
 		////std::string root = "C:/Users/phgphg/Desktop/CeresSolver/";
 		//solver.setInputDirectory("Data/scene7/");
 		//solver.setRecordViewIndices({ 1, 2, 3 });
@@ -11,12 +11,35 @@
 
 //This is added at 2024/06/09//////////////////////
 #define GLOG_USE_GLOG_EXPORT
+#ifdef _WIN32
 #include <Windows.h>
+#else
+// The little that the sources take from Windows.h, for the Linux builds of the benchmarks.
+#define DEFINE_ENUM_FLAG_OPERATORS(ENUMTYPE) \
+	inline constexpr ENUMTYPE operator|(ENUMTYPE a, ENUMTYPE b) { return ENUMTYPE((int)a | (int)b); } \
+	inline constexpr ENUMTYPE operator&(ENUMTYPE a, ENUMTYPE b) { return ENUMTYPE((int)a & (int)b); } \
+	inline constexpr ENUMTYPE operator^(ENUMTYPE a, ENUMTYPE b) { return ENUMTYPE((int)a ^ (int)b); } \
+	inline constexpr ENUMTYPE operator~(ENUMTYPE a) { return ENUMTYPE(~(int)a); } \
+	inline ENUMTYPE& operator|=(ENUMTYPE& a, ENUMTYPE b) { return a = a | b; } \
+	inline ENUMTYPE& operator&=(ENUMTYPE& a, ENUMTYPE b) { return a = a & b; } \
+	inline ENUMTYPE& operator^=(ENUMTYPE& a, ENUMTYPE b) { return a = a ^ b; }
+#define __min(a, b) (((a) < (b)) ? (a) : (b))
+#define __max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
 ///////////////////////////////////////////////////
 #include <ceres/ceres.h>
 #include <glog/logging.h>
 #include <Eigen/Dense>
 
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <cassert>
+#include <climits>
+#include <cfloat>
 #include <array>
 #include <vector>
 #include <set>
@@ -29,6 +52,9 @@
 #include <functional>
 #include <fstream>
 #include <filesystem>
+#include <thread>
+#include <atomic>
+#include <chrono>
 #include <time.h>
 #include "debug.h"
 #include "json.hpp"
@@ -49,6 +75,7 @@ using json = nlohmann::json;
 
 typedef wchar_t wchar;
 typedef unsigned char uint8;
+typedef unsigned short uint16;
 typedef unsigned int uint;
 typedef unsigned long long uint64;
 
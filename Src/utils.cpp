@@ -5,8 +5,69 @@
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 
+MappedFile::MappedFile(const std::string& filename)
+{
+#ifdef _WIN32
+	fileHandle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (fileHandle == INVALID_HANDLE_VALUE)
+		throw std::runtime_error("File open error");
+
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(fileHandle, &fileSize);
+	length = (size_t)fileSize.QuadPart;
+	if (length == 0)
+		return;
+
+	mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	base = mappingHandle ? MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (!base)
+	{
+		if (mappingHandle) CloseHandle(mappingHandle);
+		CloseHandle(fileHandle);
+		throw std::runtime_error("File open error");
+	}
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("File open error");
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		throw std::runtime_error("File open error");
+	}
+	length = (size_t)st.st_size;
+
+	// The mapping holds its own reference to the file, so the descriptor is not needed afterwards.
+	void* ptr = length > 0 ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+	close(fd);
+	if (ptr == MAP_FAILED)
+		throw std::runtime_error("File open error");
+	base = ptr;
+#endif
+}
+
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+	if (base) UnmapViewOfFile(base);
+	if (mappingHandle) CloseHandle(mappingHandle);
+	if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+#else
+	if (base) munmap((void*)base, length);
+#endif
+}
+
 
 template<typename SrcType, uint srcComp, uint trgComp, typename TrgType>
 void readBinaryImage(std::string filename, uint width, uint height, std::vector<TrgType>& out)
@@ -14,21 +75,10 @@ void readBinaryImage(std::string filename, uint width, uint height, std::vector<
 	static_assert(srcComp >= trgComp);
 	uint64 srcDataSize = height * width * srcComp * sizeof(SrcType);
 
-	SrcType* data = new SrcType[height * width * srcComp];
-	{
-		FILE* fp = fopen(filename.c_str(), "rb");
-		if (!fp)
-			throw std::runtime_error("File open error");
-
-		
-		fseek(fp, 0, SEEK_END);
-		if (ftell(fp) != srcDataSize)
-			throw std::runtime_error("File data match error");
-
-		fseek(fp, 0, SEEK_SET);
-		fread(data, 1, srcDataSize, fp);
-		fclose(fp);
-	}
+	// Converted straight from the mapped pages, without an intermediate copy of the file.
+	MappedFile file(filename);
+	if (file.size() != srcDataSize)
+		throw std::runtime_error("File data match error");
 
 	out.clear();
 	out.shrink_to_fit();
@@ -39,7 +89,7 @@ void readBinaryImage(std::string filename, uint width, uint height, std::vector<
 	}
 	else
 	{
-		static_assert(sizeof(TrgType) == sizeof(TrgType::value_type) * trgComp);
+		static_assert(sizeof(TrgType) == sizeof(typename TrgType::value_type) * trgComp);
 		out.resize(height * width);
 	}
 
@@ -50,7 +100,7 @@ void readBinaryImage(std::string filename, uint width, uint height, std::vector<
 			return (typename TrgType::value_type*)x;
 	};
 
-	SrcType* src = data;
+	const SrcType* src = (const SrcType*)file.data();
 	auto* trg = foo(out.data());
 	using EleType = std::decay_t<decltype(*trg)>;
 
@@ -66,8 +116,6 @@ void readBinaryImage(std::string filename, uint width, uint height, std::vector<
 				trg[j] = (EleType)src[j];
 		}
 	}
-
-	delete[] data;
 }
 template void readBinaryImage<float, 4, 3>(std::string filename, uint width, uint height, std::vector<Eigen::Vector3d>& out);
 template void readBinaryImage<float, 4, 3>(std::string filename, uint width, uint height, std::vector<double>& out);
@@ -75,6 +123,128 @@ template void readBinaryImage<float, 1>(std::string filename, uint width, uint h
 template void readBinaryImage<uint, 1>(std::string filename, uint width, uint height, std::vector<uint>& out);
 
 
+// Four independent lanes of multiply-rotate rounds, so that long ranges hash at memory speed.
+uint64 hashBytes(const void* data, size_t bytes, uint64 seed)
+{
+	constexpr uint64 kPrime1 = 0x9E3779B185EBCA87ull;
+	constexpr uint64 kPrime2 = 0xC2B2AE3D27D4EB4Full;
+	constexpr uint64 kPrime3 = 0x165667B19E3779F9ull;
+
+	auto rotl = [](uint64 x, int r) { return (x << r) | (x >> (64 - r)); };
+	auto round = [&](uint64 acc, uint64 word) { return rotl(acc + word * kPrime2, 31) * kPrime1; };
+
+	const char* bytePtr = (const char*)data;
+	uint64 lanes[4] = { seed + kPrime1 + kPrime2, seed + kPrime2, seed, seed - kPrime1 };
+
+	size_t offset = 0;
+	for (; offset + 32 <= bytes; offset += 32)
+	{
+		uint64 words[4];
+		memcpy(words, bytePtr + offset, 32);
+		for (int i = 0; i < 4; ++i)
+			lanes[i] = round(lanes[i], words[i]);
+	}
+
+	uint64 h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18) + bytes;
+	for (; offset + 8 <= bytes; offset += 8)
+	{
+		uint64 word;
+		memcpy(&word, bytePtr + offset, 8);
+		h = rotl(h ^ round(0, word), 27) * kPrime1 + kPrime3;
+	}
+	for (; offset < bytes; ++offset)
+		h = rotl(h ^ ((uint8)bytePtr[offset] * kPrime3), 11) * kPrime1;
+
+	h ^= h >> 33;
+	h *= kPrime2;
+	h ^= h >> 29;
+	h *= kPrime3;
+	h ^= h >> 32;
+	return h;
+}
+
+
+bool writeFloatImage(const std::string& filename, const double* src, int width, int height, int channels)
+{
+	TRACE_SCOPE("writeFloatImage");
+	const int fileChannels = (channels == 1) ? 1 : 3;
+	std::string header = std::string(fileChannels == 1 ? "Pf" : "PF") + "\n" +
+		std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+
+	// Header and rows go out in one write. PFM stores the bottom row first, as little-endian floats.
+	std::vector<char> buffer(header.size() + (size_t)width * height * fileChannels * sizeof(float));
+	memcpy(buffer.data(), header.data(), header.size());
+	char* trg = buffer.data() + header.size();
+
+	for (int i = height - 1; i >= 0; --i)
+	{
+		for (int j = 0; j < width; ++j)
+		{
+			const double* texel = src + ((size_t)i * width + j) * channels;
+			for (int c = 0; c < fileChannels; ++c, trg += sizeof(float))
+			{
+				float value = (c < channels) ? (float)texel[c] : 0.0f;
+				memcpy(trg, &value, sizeof(float));
+			}
+		}
+	}
+
+	FILE* fp = fopen(filename.c_str(), "wb");
+	if (!fp)
+		return false;
+	bool written = fwrite(buffer.data(), 1, buffer.size(), fp) == buffer.size();
+	return (fclose(fp) == 0) && written;
+}
+
+
+bool readFloatImage(const std::string& filename, int width, int height, int channels, double* out)
+{
+	try
+	{
+		MappedFile file(filename);
+		const char* data = (const char*)file.data();
+
+		// Three lines of text: the type, the size and the scale, whose sign gives the byte order.
+		size_t headerSize = 0;
+		for (int lines = 0; lines < 3 && headerSize < file.size(); ++headerSize)
+			lines += (data[headerSize] == '\n');
+
+		std::string header(data, headerSize);
+		char type[3] = {};
+		int fileWidth = 0, fileHeight = 0;
+		double scale = 0.0;
+		if (sscanf(header.c_str(), "%2s %d %d %lf", type, &fileWidth, &fileHeight, &scale) != 4 || scale >= 0.0)
+			return false;
+
+		const int fileChannels = (strcmp(type, "Pf") == 0) ? 1 : (strcmp(type, "PF") == 0) ? 3 : 0;
+		if (fileChannels != ((channels == 1) ? 1 : 3) || fileWidth != width || fileHeight != height ||
+			file.size() != headerSize + (size_t)width * height * fileChannels * sizeof(float))
+			return false;
+
+		// The header length is arbitrary, so the floats are copied out rather than read in place.
+		const char* src = data + headerSize;
+		for (int i = height - 1; i >= 0; --i)
+		{
+			for (int j = 0; j < width; ++j, src += fileChannels * sizeof(float))
+			{
+				double* texel = out + ((size_t)i * width + j) * channels;
+				for (int c = 0; c < channels; ++c)
+				{
+					float value;
+					memcpy(&value, src + c * sizeof(float), sizeof(float));
+					texel[c] = value;
+				}
+			}
+		}
+		return true;
+	}
+	catch (std::runtime_error&)
+	{
+		return false;
+	}
+}
+
+
 void writeImage(
 	const std::string& filename, 
 	const double* src, 
@@ -85,6 +255,7 @@ void writeImage(
 	double max,
 	bool srgb)
 {
+	TRACE_SCOPE("writeImage");
 	constexpr double gamma = 1.0 / 2.2;
 	constexpr double nearlyOne = 1.0 - 1e-8;
 	auto encode = [&](const double& x) {
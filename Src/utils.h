@@ -1,11 +1,69 @@
 #pragma once
 #include "pch.h"
+#include "SharedMap.h"
+
+
+// Read-only mapping of a whole file. Pages are read from the disk when they are first touched.
+class MappedFile
+{
+	const void* base = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	HANDLE fileHandle = INVALID_HANDLE_VALUE;
+	HANDLE mappingHandle = nullptr;
+#endif
+
+public:
+	MappedFile(const std::string& filename);
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const void* data() const	{ return base; }
+	size_t size() const			{ return length; }
+};
+
+
+// The map reads its texels straight from the file mapping, which stays alive while some copy of the map uses it.
+// Only the rows [firstRow, endRow) are part of the map.
+template<typename T, typename Stored>
+void mapBinaryImage(std::string filename, uint width, uint height, SharedMap<T, Stored>& out, uint firstRow = 0, uint endRow = ~0u)
+{
+	auto file = std::make_shared<MappedFile>(filename);
+	if (file->size() != (size_t)width * height * sizeof(Stored))
+		throw std::runtime_error("File data match error");
+
+	endRow = std::min(endRow, height);
+	const Stored* texels = (const Stored*)file->data() + (size_t)firstRow * width;
+	out.map(std::move(file), texels, (size_t)(endRow - firstRow) * width, (size_t)firstRow * width);
+}
+
+
+// Reads one byte of every page, so that the pages of a mapping are loaded by the calling thread.
+inline void touchPages(const void* data, size_t bytes)
+{
+	constexpr size_t kPageSize = 4096;
+	const volatile char* bytePtr = (const volatile char*)data;
+	char sum = 0;
+	for (size_t offset = 0; offset < bytes; offset += kPageSize)
+		sum += bytePtr[offset];
+	(void)sum;
+}
+
+
+// Fast non-cryptographic hash of a byte range, e.g. to key cached data by the content of its inputs.
+uint64 hashBytes(const void* data, size_t bytes, uint64 seed = 0);
 
 
 template<typename SrcType, uint srcComp, uint trgComp = srcComp, typename TrgType>
 void readBinaryImage(std::string filename, uint width, uint height, std::vector<TrgType>& out);
 
 
+// Lossless float images in the PFM layout, with one or three channels. Two channel maps are padded to three.
+bool writeFloatImage(const std::string& filename, const double* src, int width, int height, int channels);
+bool readFloatImage(const std::string& filename, int width, int height, int channels, double* out);
+
+
 void writeImage(
 	const std::string& filename, 
 	const double* src, 
@@ -14,4 +72,23 @@ void writeImage(
 	int channels, 
 	double min = 0.0,
 	double max = 1.0,
-	bool srgb = false);
\ No newline at end of file
+	bool srgb = false);
+
+
+template<typename Func>
+void parallelFor(int begin, int end, int numThreads, Func&& func)
+{
+	std::atomic<int> next = begin;
+	auto worker = [&]() {
+		for (int i = next++; i < end; i = next++)
+			func(i);
+	};
+
+	std::vector<std::thread> threads;
+	for (int t = 1; t < std::min(numThreads, end - begin); ++t)
+		threads.emplace_back(worker);
+	worker();
+
+	for (auto& thread : threads)
+		thread.join();
+}
\ No newline at end of file